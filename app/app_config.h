@@ -3,7 +3,8 @@
 #define VERSION_MAJOR		3
 #define VERSION_MINOR		1
 
-#define KEY_FIFO_SIZE		31       // number of keys in the public FIFO
+#define KEY_FIFO_SIZE		31       // number of keys in the public FIFO, until REG_ID_FDP changes it
+#define KEY_FIFO_POOL		512      // most keys the public FIFO can hold, a power of two
 
 #define ENABLE_ESP32_SUPPORT 1
 
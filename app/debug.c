@@ -2,6 +2,7 @@
 
 #include "app_config.h"
 #include "gpioexp.h"
+#include "key_ring.h"
 #include "keyboard.h"
 #include "reg.h"
 #include "touchpad.h"
@@ -15,12 +16,6 @@
 
 #define PICO_STDIO_USB_STDOUT_TIMEOUT_US 500000
 
-static void key_cb(uint8_t key, enum key_state state)
-{
-	printf("key: 0x%02X/%d/%c, state: %d\r\n", key, key, key, state);
-}
-static struct key_callback key_callback = { .func = key_cb };
-
 static void touch_cb(int8_t x, int8_t y)
 {
 	printf("%s: x: %d, y: %d !\r\n", __func__, x, y);
@@ -89,9 +84,21 @@ void debug_init(void)
 
 	printf("I2C Puppet SW v%d.%d\r\n", VERSION_MAJOR, VERSION_MINOR);
 
-	keyboard_add_key_callback(&key_callback);
-
 	touchpad_add_touch_callback(&touch_callback);
 
 	gpioexp_add_int_callback(&gpioexp_callback);
 }
+
+void debug_task(void)
+{
+#ifndef NDEBUG
+	struct fifo_item item;
+
+	// printed from the main loop, the scan alarm doesn't wait for the CDC
+	while (key_ring_peek(KEY_RING_DEBUG, &item)) {
+		key_ring_skip(KEY_RING_DEBUG);
+
+		printf("key: 0x%02X/%d/%c, state: %d\r\n", item.scancode, item.scancode, item.scancode, item.state);
+	}
+#endif
+}
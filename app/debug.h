@@ -1,3 +1,6 @@
 #pragma once
 
+// Prints what came in since the last call, from the main loop
+void debug_task(void);
+
 void debug_init(void);
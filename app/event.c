@@ -0,0 +1,226 @@
+#include "event.h"
+
+#include "gpioexp.h"
+#include "interrupt.h"
+#include "reg.h"
+#include "touchpad.h"
+
+#include <hardware/sync.h>
+#include <pico/stdlib.h>
+
+// Slots in the queue, a power of two so indexing is a mask
+#define EVENT_SLOTS			128
+#define EVENT_MASK			(EVENT_SLOTS - 1)
+
+_Static_assert((EVENT_SLOTS & EVENT_MASK) == 0, "EVENT_SLOTS has to be a power of two");
+
+// Unlike the key FIFO there are producers in several interrupts (some of them preempt others), and
+// touch motion rewrites queued events, so adding runs with interrupts off. So do the register reads.
+static struct
+{
+	struct event events[EVENT_SLOTS];
+	volatile uint16_t head;
+	volatile uint16_t tail;
+
+	// events before this one were handed to the host, they can't change anymore
+	uint16_t frozen;
+
+	// events dropped since the last EVENT_SYSTEM_OVERFLOW
+	uint8_t lost;
+
+	// when the last event that was discarded happened
+	uint32_t last_time_us;
+} self;
+
+static int16_t add_clamped(int16_t value, int16_t add)
+{
+	const int32_t result = (int32_t)value + add;
+
+	return MAX(INT16_MIN, MIN(result, INT16_MAX));
+}
+
+static void raise_interrupt(void)
+{
+	if (reg_is_bit_set(REG_ID_IN2, IN2_EVENT))
+		return;
+
+	reg_set_bit(REG_ID_IN2, IN2_EVENT);
+	reg_set_bit(REG_ID_INT, INT_IN2);
+
+	interrupt_trigger();
+}
+
+static void store(uint8_t type, const uint8_t data[4])
+{
+	const uint16_t head = self.head;
+	struct event *event = &self.events[head & EVENT_MASK];
+
+	event->type = type;
+	event->data[0] = data[0];
+	event->data[1] = data[1];
+	event->data[2] = data[2];
+	event->data[3] = data[3];
+	event->time_us = time_us_32();
+
+	self.head = head + 1;
+}
+
+// interrupts have to be off, returns whether the event made it in
+static bool push_locked(uint8_t type, const uint8_t data[4])
+{
+	const uint16_t count = self.head - self.tail;
+
+	// the overflow event needs a slot of its own, in front of the event that made it in
+	if (count + (self.lost ? 2 : 1) > EVENT_SLOTS) {
+		if (self.lost < UINT8_MAX)
+			self.lost++;
+
+		return false;
+	}
+
+	if (self.lost) {
+		const uint8_t overflow[4] = { EVENT_SYSTEM_OVERFLOW, self.lost };
+
+		store(EVENT_SYSTEM, overflow);
+		self.lost = 0;
+	}
+
+	store(type, data);
+
+	return true;
+}
+
+static void push(uint8_t type, const uint8_t data[4])
+{
+	if (!reg_is_bit_set(REG_ID_CF2, CF2_EVENTS))
+		return;
+
+	const uint32_t irq = save_and_disable_interrupts();
+	const bool pushed = push_locked(type, data);
+	restore_interrupts(irq);
+
+	if (pushed)
+		raise_interrupt();
+}
+
+void event_push_key(uint8_t key, uint8_t state, uint8_t mods, uint8_t source)
+{
+	const uint8_t data[4] = { key, state, mods, source };
+
+	push(EVENT_KEY, data);
+}
+
+void event_push_system(enum event_system code, uint8_t arg)
+{
+	const uint8_t data[4] = { code, arg };
+
+	push(EVENT_SYSTEM, data);
+}
+
+// a host that's behind gets one event with the sum of the motion instead of many small ones,
+// interrupts have to be off
+static bool merge_touch(int8_t x, int8_t y)
+{
+	const uint16_t newest = self.head - 1;
+	struct event *event = &self.events[newest & EVENT_MASK];
+
+	const bool merge = (self.head != self.tail) && ((int16_t)(newest - self.frozen) >= 0) &&
+		(event->type == EVENT_TOUCH);
+
+	if (merge) {
+		const int16_t dx = add_clamped(event->data[0] | (event->data[1] << 8), x);
+		const int16_t dy = add_clamped(event->data[2] | (event->data[3] << 8), y);
+
+		event->data[0] = dx & 0xFF;
+		event->data[1] = (dx >> 8) & 0xFF;
+		event->data[2] = dy & 0xFF;
+		event->data[3] = (dy >> 8) & 0xFF;
+		event->time_us = time_us_32();
+	}
+
+	return merge;
+}
+
+static void touch_cb(int8_t x, int8_t y)
+{
+	if (!reg_is_bit_set(REG_ID_CF2, CF2_EVENTS))
+		return;
+
+	const uint8_t data[4] = { x & 0xFF, (x < 0) ? 0xFF : 0x00, y & 0xFF, (y < 0) ? 0xFF : 0x00 };
+	const uint32_t irq = save_and_disable_interrupts();
+	const bool pushed = !merge_touch(x, y) && push_locked(EVENT_TOUCH, data);
+	restore_interrupts(irq);
+
+	if (pushed)
+		raise_interrupt();
+}
+static struct touch_callback touch_callback = { .func = touch_cb };
+
+static void gpioexp_cb(uint8_t gpio, uint8_t gpio_idx)
+{
+	// same pins that can interrupt, see REG_ID_GIC
+	if (!reg_is_bit_set(REG_ID_GIC, (1 << gpio_idx)))
+		return;
+
+	const uint8_t data[4] = { gpio_idx, gpio_get(gpio) };
+
+	push(EVENT_GPIO, data);
+}
+static struct gpioexp_callback gpioexp_callback = { .func = gpioexp_cb };
+
+uint16_t event_count(void)
+{
+	return (uint16_t)(self.head - self.tail);
+}
+
+struct event event_peek(uint16_t idx)
+{
+	struct event event = { 0 };
+	if (idx >= event_count())
+		return event;
+
+	return self.events[(uint16_t)(self.tail + idx) & EVENT_MASK];
+}
+
+uint32_t event_delta_us(uint16_t idx)
+{
+	if (idx >= event_count())
+		return 0;
+
+	const uint32_t previous = (idx == 0) ? self.last_time_us : event_peek(idx - 1).time_us;
+
+	return event_peek(idx).time_us - previous;
+}
+
+void event_freeze(uint16_t count)
+{
+	self.frozen = self.tail + MIN(count, event_count());
+}
+
+void event_discard(uint16_t count)
+{
+	if (count > event_count())
+		count = event_count();
+
+	if (count > 0)
+		self.last_time_us = event_peek(count - 1).time_us;
+
+	self.tail += count;
+
+	if ((event_count() > 0) || !reg_is_bit_set(REG_ID_IN2, IN2_EVENT))
+		return;
+
+	reg_clear_bit(REG_ID_IN2, IN2_EVENT);
+
+	if (reg_get_value(REG_ID_IN2) == 0)
+		reg_clear_bit(REG_ID_INT, INT_IN2);
+
+	interrupt_sync();
+}
+
+void event_init(void)
+{
+	touchpad_add_touch_callback(&touch_callback);
+
+	gpioexp_add_int_callback(&gpioexp_callback);
+}
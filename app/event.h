@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+// Bytes each event takes in a REG_ID_EVQ read: type, the 4 data bytes and the time since the one before
+#define EVENT_LEN			9
+
+// What the data bytes of an event mean
+enum event_type
+{
+	EVENT_KEY = 1,		// scancode, enum key_state, FIFO_MOD_*, enum key_source
+	EVENT_TOUCH = 2,	// x and y, int16 little endian each
+	EVENT_GPIO = 3,		// expander pin, level
+	EVENT_SYSTEM = 4,	// enum event_system, argument
+};
+
+enum event_system
+{
+	EVENT_SYSTEM_OVERFLOW = 0,	// events that didn't fit in the queue (saturates at 255)
+	EVENT_SYSTEM_POWER_ON = 1,	// the Pi was powered on, enum power_on_reason
+	EVENT_SYSTEM_POWER_OFF = 2,	// the Pi loses power in this many seconds (saturates at 255)
+};
+
+struct event
+{
+	uint8_t type; // enum event_type
+	uint8_t data[4];
+	uint32_t time_us;
+};
+
+// All of them are dropped unless CF2_EVENTS is set
+void event_push_key(uint8_t key, uint8_t state, uint8_t mods, uint8_t source);
+void event_push_system(enum event_system code, uint8_t arg);
+
+uint16_t event_count(void);
+struct event event_peek(uint16_t idx);
+
+// Time between the event at idx and the one before it, the last one removed for idx 0
+uint32_t event_delta_us(uint16_t idx);
+
+// The first count events went out to the host, touch motion isn't merged into them anymore
+void event_freeze(uint16_t count);
+
+// Once the queue is empty IN2_EVENT is cleared too
+void event_discard(uint16_t count);
+
+void event_init(void);
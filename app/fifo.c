@@ -1,60 +1,266 @@
 #include "app_config.h"
 #include "fifo.h"
 
+#include <hardware/sync.h>
+#include <pico/stdlib.h>
+
+// Indexing is a mask, and the indices run freely and wrap at 65536, which the pool divides evenly
+#define FIFO_MASK			(KEY_FIFO_POOL - 1)
+
+_Static_assert((KEY_FIFO_POOL & FIFO_MASK) == 0, "KEY_FIFO_POOL has to be a power of two");
+_Static_assert((KEY_FIFO_SIZE <= KEY_FIFO_POOL) && (KEY_FIFO_POOL <= 32768), "KEY_FIFO_SIZE doesn't fit the ring");
+
+// Single producer (the key scan) and single consumer (register reads, which run with interrupts off).
+// Only the producer moves head and only the consumer moves tail, so neither needs a lock, the
+// barriers make sure an item is in place before the index that publishes it.
 static struct
 {
-	struct fifo_item fifo[KEY_FIFO_SIZE];
-	uint8_t count;
-	uint8_t read_idx;
-	uint8_t write_idx;
-} self;
+	struct fifo_item fifo[KEY_FIFO_POOL];
+	volatile uint16_t head;
+	volatile uint16_t tail;
+
+	volatile uint16_t capacity;
+	uint16_t watermark;
+
+	// the first ones were peeked at and are on their way to the host, see fifo_reserve()
+	uint16_t reserved;
+
+	struct fifo_stats stats;
 
-uint8_t fifo_count(void)
+	// when the last item that was dequeued/discarded happened
+	uint32_t last_time_us;
+} self =
 {
-	return self.count;
+	.capacity = KEY_FIFO_SIZE,
+};
+
+uint16_t fifo_count(void)
+{
+	return (uint16_t)(self.head - self.tail);
 }
 
 void fifo_flush(void)
 {
-	self.write_idx = 0;
-	self.read_idx = 0;
-	self.count = 0;
+	self.tail = self.head;
+	self.reserved = 0;
 }
 
-bool fifo_enqueue(const struct fifo_item item)
+static bool push(const struct fifo_item *item, uint16_t capacity)
 {
-	if (self.count >= KEY_FIFO_SIZE)
+	const uint16_t head = self.head;
+
+	if ((uint16_t)(head - self.tail) >= capacity)
 		return false;
 
-	self.fifo[self.write_idx++] = item;
+	self.fifo[head & FIFO_MASK] = *item;
+
+	__dmb();
+	self.head = head + 1;
 
-	self.write_idx %= KEY_FIFO_SIZE;
-	++self.count;
+	return true;
+}
+
+static void count_enqueued(void)
+{
+	self.stats.enqueued++;
+	self.stats.peak = MAX(self.stats.peak, fifo_count());
+}
+
+bool fifo_enqueue(const struct fifo_item item)
+{
+	if (!push(&item, self.capacity)) {
+		self.stats.dropped++;
+		return false;
+	}
+
+	count_enqueued();
 
 	return true;
 }
 
+static struct fifo_item *slot(uint16_t idx)
+{
+	return &self.fifo[(uint16_t)(self.tail + idx) & FIFO_MASK];
+}
+
+// the items before idx move up by one, interrupts have to be off
+static void remove_at(uint16_t idx)
+{
+	for (uint16_t i = idx; i > 0; --i)
+		*slot(i) = *slot(i - 1);
+
+	self.tail++;
+}
+
+// interrupts have to be off, returns whether there's room now. The reserved items stay where they
+// are, fifo_discard() has to drop exactly the ones the host got.
+static bool evict(void)
+{
+	const uint16_t count = fifo_count();
+	const uint16_t first = MIN(self.reserved, count);
+
+	for (uint16_t i = first; i < count; ++i) {
+		if (slot(i)->state == KEY_STATE_HOLD) {
+			remove_at(i);
+			self.stats.evicted_hold++;
+			return true;
+		}
+	}
+
+	// the host never learns about the pair, but the key ends up where it was
+	for (uint16_t i = first; i < count; ++i) {
+		if (slot(i)->state != KEY_STATE_PRESSED)
+			continue;
+
+		for (uint16_t j = i + 1; j < count; ++j) {
+			if ((slot(j)->scancode != slot(i)->scancode) || (slot(j)->state != KEY_STATE_RELEASED))
+				continue;
+
+			// the later one first, removing it moves the press up
+			remove_at(j);
+			remove_at(i + 1);
+			self.stats.merged_pairs++;
+			return true;
+		}
+	}
+
+	// its release is still to come, and a release of a key the host thinks is up is harmless
+	for (uint16_t i = first; i < count; ++i) {
+		if (slot(i)->state == KEY_STATE_PRESSED) {
+			remove_at(i);
+			self.stats.evicted_press++;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// the drop was already counted by the fifo_enqueue() that failed before
 void fifo_enqueue_force(const struct fifo_item item)
 {
-	if (fifo_enqueue(item))
+	if (push(&item, self.capacity)) {
+		count_enqueued();
 		return;
+	}
+
+	// the only time the producer moves tail, keep the consumer out while it does
+	const uint32_t irq = save_and_disable_interrupts();
+
+	// a lowered capacity can leave more than one item to go
+	bool room = true;
+
+	while (room && (fifo_count() >= self.capacity))
+		room = evict();
+
+	bool pushed = room && push(&item, self.capacity);
+
+	// only releases are left, a dropped one would leave a key stuck on the host
+	if (!pushed && (item.state == KEY_STATE_RELEASED)) {
+		pushed = push(&item, KEY_FIFO_POOL);
+
+		if (pushed)
+			self.stats.kept_release++;
+	}
+
+	if (!pushed)
+		self.stats.rejected++;
 
-	self.fifo[self.write_idx++] = item;
-	self.write_idx %= KEY_FIFO_SIZE;
+	restore_interrupts(irq);
 
-	self.read_idx++;
-	self.read_idx %= KEY_FIFO_SIZE;
+	if (pushed)
+		count_enqueued();
 }
 
 struct fifo_item fifo_dequeue(void)
 {
 	struct fifo_item item = { 0 };
-	if (self.count == 0)
+	const uint16_t tail = self.tail;
+
+	if (self.head == tail)
 		return item;
 
-	item = self.fifo[self.read_idx++];
-	self.read_idx %= KEY_FIFO_SIZE;
-	--self.count;
+	__dmb();
+	item = self.fifo[tail & FIFO_MASK];
+
+	__dmb();
+	self.tail = tail + 1;
+
+	if (self.reserved > 0)
+		self.reserved--;
+
+	self.last_time_us = item.time_us;
 
 	return item;
 }
+
+struct fifo_item fifo_peek(uint16_t idx)
+{
+	struct fifo_item item = { 0 };
+	if (idx >= fifo_count())
+		return item;
+
+	__dmb();
+
+	return self.fifo[(uint16_t)(self.tail + idx) & FIFO_MASK];
+}
+
+void fifo_discard(uint16_t count)
+{
+	if (count > fifo_count())
+		count = fifo_count();
+
+	if (count > 0)
+		self.last_time_us = fifo_peek(count - 1).time_us;
+
+	__dmb();
+	self.tail += count;
+
+	// whatever else was peeked didn't make it out, it's free to go again
+	self.reserved = 0;
+}
+
+void fifo_reserve(uint16_t count)
+{
+	self.reserved = MIN(count, fifo_count());
+}
+
+uint32_t fifo_delta_us(uint16_t idx)
+{
+	if (idx >= fifo_count())
+		return 0;
+
+	const uint32_t previous = (idx == 0) ? self.last_time_us : fifo_peek(idx - 1).time_us;
+
+	return fifo_peek(idx).time_us - previous;
+}
+
+void fifo_set_capacity(uint16_t capacity)
+{
+	self.capacity = MAX(1, MIN(capacity, KEY_FIFO_POOL));
+}
+
+uint16_t fifo_get_capacity(void)
+{
+	return self.capacity;
+}
+
+void fifo_set_watermark(uint16_t watermark)
+{
+	self.watermark = watermark;
+}
+
+uint16_t fifo_get_watermark(void)
+{
+	return self.watermark;
+}
+
+const struct fifo_stats *fifo_get_stats(void)
+{
+	return &self.stats;
+}
+
+void fifo_reset_stats(void)
+{
+	self.stats = (struct fifo_stats){ .peak = fifo_count() };
+}
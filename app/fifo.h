@@ -2,16 +2,70 @@
 
 #include "keyboard.h"
 
+// Bytes a REG_ID_FIF read (and each REG_ID_FIB entry) takes, see CF2_FIFO_V2
+#define FIFO_ITEM_LEN		2
+#define FIFO_ITEM_V2_LEN	8
+
+// Modifiers held down when a key event happened, byte 2 of the v2 format. Not the KEY_MOD_* of
+// input-event-codes.h, those are the USB HID ones.
+#define FIFO_MOD_SHL		(1 << 0) // left shift
+#define FIFO_MOD_SHR		(1 << 1) // right shift
+#define FIFO_MOD_ALT		(1 << 2) // physical alt
+#define FIFO_MOD_SYM		(1 << 3) // symbol (right alt)
+
 struct fifo_item
 {
 	uint8_t scancode;
 
 	uint8_t _ : 4;
 	enum key_state state : 4;
+
+	// only reported in the v2 format
+	uint8_t mods; // FIFO_MOD_*
+	uint8_t source; // enum key_source
+	uint32_t time_us;
+};
+
+struct fifo_stats
+{
+	uint16_t peak;		// most items that were queued at once
+	uint32_t enqueued;
+	uint32_t dropped;	// new items that didn't fit, whether or not fifo_enqueue_force() made room
+
+	// what fifo_enqueue_force() did about it
+	uint32_t evicted_hold;	// a queued HOLD was dropped
+	uint32_t merged_pairs;	// a queued press and release of the same key were dropped together
+	uint32_t evicted_press;	// a queued press without a queued release was dropped
+	uint32_t kept_release;	// the new item was a release, it went in over the capacity
+	uint32_t rejected;		// nothing could go, the new item was dropped
 };
 
-uint8_t fifo_count(void);
+uint16_t fifo_count(void);
 void fifo_flush(void);
 bool fifo_enqueue(const struct fifo_item item);
+
+// Make room once fifo_enqueue() failed: drops a HOLD, else a press and release pair of the same key,
+// else a press, the oldest first. A release the host hasn't seen the press of is never dropped.
 void fifo_enqueue_force(const struct fifo_item item);
 struct fifo_item fifo_dequeue(void);
+struct fifo_item fifo_peek(uint16_t idx);
+void fifo_discard(uint16_t count);
+
+// The first count items were peeked at to be sent, fifo_enqueue_force() doesn't evict them until
+// they're dequeued or the next fifo_discard(). Has to be called with interrupts off.
+void fifo_reserve(uint16_t count);
+
+// Time between the item at idx and the one before it, the last one removed for idx 0
+uint32_t fifo_delta_us(uint16_t idx);
+
+// How many items fit, 1 to KEY_FIFO_POOL. Items over a lowered capacity stay queued
+// until they're read, or evicted by the next fifo_enqueue_force().
+void fifo_set_capacity(uint16_t capacity);
+uint16_t fifo_get_capacity(void);
+
+// INT_IN2/IN2_FIFO_WM fire once this many items are queued, 0 for never
+void fifo_set_watermark(uint16_t watermark);
+uint16_t fifo_get_watermark(void);
+
+const struct fifo_stats *fifo_get_stats(void);
+void fifo_reset_stats(void);
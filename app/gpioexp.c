@@ -20,9 +20,9 @@ static void set_dir(uint8_t gpio, uint8_t gpio_idx, uint8_t dir)
 	if (dir == DIR_INPUT) {
 		if (reg_is_bit_set(REG_ID_PUE, (1 << gpio_idx))) {
 			if (reg_is_bit_set(REG_ID_PUD, (1 << gpio_idx)) == PUD_UP) {
-				gpio_is_pulled_up(gpio);
+				gpio_pull_up(gpio);
 			} else {
-				gpio_is_pulled_down(gpio);
+				gpio_pull_down(gpio);
 			}
 		} else {
 			gpio_disable_pulls(gpio);
@@ -90,94 +90,64 @@ void gpioexp_gpio_irq(uint gpio, uint32_t events)
 #endif
 }
 
-void gpioexp_update_dir(uint8_t new_dir)
+void gpioexp_update(uint8_t new_dir, uint8_t new_pue, uint8_t new_pud)
 {
 #ifndef NDEBUG
-	printf("%s: dir: 0x%02X\r\n", __func__, new_dir);
+	printf("%s: dir: 0x%02X, pue: 0x%02X, pud: 0x%02X\r\n", __func__, new_dir, new_pue, new_pud);
 #endif
 
 	const uint8_t old_dir = reg_get_value(REG_ID_DIR);
-
-	(void)old_dir; // Shut up warning in case no GPIOs configured
-
-#define UPDATE_DIR(bit) \
-	if ((old_dir & (1 << bit)) != (new_dir & (1 << bit))) \
-		set_dir(PIN_GPIOEXP ## bit, bit, (new_dir & (1 << bit)) != 0);
-
-#ifdef PIN_GPIOEXP0
-	UPDATE_DIR(0)
-#endif
-#ifdef PIN_GPIOEXP1
-	UPDATE_DIR(1)
-#endif
-#ifdef PIN_GPIOEXP2
-	UPDATE_DIR(2)
-#endif
-#ifdef PIN_GPIOEXP3
-	UPDATE_DIR(3)
-#endif
-#ifdef PIN_GPIOEXP4
-	UPDATE_DIR(4)
-#endif
-#ifdef PIN_GPIOEXP5
-	UPDATE_DIR(5)
-#endif
-#ifdef PIN_GPIOEXP6
-	UPDATE_DIR(6)
-#endif
-#ifdef PIN_GPIOEXP7
-	UPDATE_DIR(7)
-#endif
-}
-
-void gpioexp_update_pue_pud(uint8_t new_pue, uint8_t new_pud)
-{
-#ifndef NDEBUG
-	printf("%s: pue: 0x%02X, pud: 0x%02X\r\n", __func__, new_pue, new_pud);
-#endif
-
 	const uint8_t old_pue = reg_get_value(REG_ID_PUE);
 	const uint8_t old_pud = reg_get_value(REG_ID_PUD);
 
-	// Shut up warnings in case no GPIOs configured
-	(void)old_pue;
-	(void)old_pud;
+	// Pins that need to be reconfigured, each one only once no matter how many settings changed
+	const uint8_t changed = (old_dir ^ new_dir) | (old_pue ^ new_pue) | (old_pud ^ new_pud);
+
+	(void)changed; // Shut up warning in case no GPIOs configured
 
 	reg_set_value(REG_ID_PUE, new_pue);
 	reg_set_value(REG_ID_PUD, new_pud);
 
-#define UPDATE_PULL(bit) \
-	if (((old_pue & (1 << bit)) != (new_pue & (1 << bit))) || \
-		((old_pud & (1 << bit)) != (new_pud & (1 << bit)))) { \
-		set_dir(PIN_GPIOEXP ## bit, bit, reg_is_bit_set(REG_ID_DIR, (1 << bit))); \
-	}
+#define UPDATE(bit) \
+	if (changed & (1 << bit)) \
+		set_dir(PIN_GPIOEXP ## bit, bit, (new_dir & (1 << bit)) != 0);
 
 #ifdef PIN_GPIOEXP0
-	UPDATE_PULL(0)
+	UPDATE(0)
 #endif
 #ifdef PIN_GPIOEXP1
-	UPDATE_PULL(1)
+	UPDATE(1)
 #endif
 #ifdef PIN_GPIOEXP2
-	UPDATE_PULL(2)
+	UPDATE(2)
 #endif
 #ifdef PIN_GPIOEXP3
-	UPDATE_PULL(3)
+	UPDATE(3)
 #endif
 #ifdef PIN_GPIOEXP4
-	UPDATE_PULL(4)
+	UPDATE(4)
 #endif
 #ifdef PIN_GPIOEXP5
-	UPDATE_PULL(5)
+	UPDATE(5)
 #endif
 #ifdef PIN_GPIOEXP6
-	UPDATE_PULL(6)
+	UPDATE(6)
 #endif
 #ifdef PIN_GPIOEXP7
-	UPDATE_PULL(7)
+	UPDATE(7)
 #endif
 }
 
+void gpioexp_update_dir(uint8_t new_dir)
+{
+	gpioexp_update(new_dir, reg_get_value(REG_ID_PUE), reg_get_value(REG_ID_PUD));
+}
+
+void gpioexp_update_pue_pud(uint8_t new_pue, uint8_t new_pud)
+{
+	gpioexp_update(reg_get_value(REG_ID_DIR), new_pue, new_pud);
+}
+
 void gpioexp_set_value(uint8_t value)
 {
 #ifndef NDEBUG
@@ -10,6 +10,7 @@ struct gpioexp_callback
 
 void gpioexp_gpio_irq(uint gpio, uint32_t events);
 
+void gpioexp_update(uint8_t dir, uint8_t pue, uint8_t pud);
 void gpioexp_update_dir(uint8_t dir);
 void gpioexp_update_pue_pud(uint8_t pue, uint8_t pud);
 
@@ -0,0 +1,157 @@
+#include "gpioexp_i2c.h"
+
+#include "gpioexp.h"
+#include "interrupt.h"
+#include "reg.h"
+
+#include <pico/stdlib.h>
+#include <string.h>
+
+// PCAL6408 registers, the ones above 0x40 are the PCAL extensions
+#define REG_INPUT			0x00
+#define REG_OUTPUT			0x01
+#define REG_POLARITY		0x02
+#define REG_CONFIG			0x03 // 1 is input, same as REG_ID_DIR
+#define REG_DRIVE_0			0x40
+#define REG_DRIVE_1			0x41
+#define REG_INPUT_LATCH		0x42
+#define REG_PULL_ENABLE		0x43 // same as REG_ID_PUE
+#define REG_PULL_SELECT		0x44 // 1 is pull-up, same as REG_ID_PUD
+#define REG_INT_MASK		0x45 // 1 is masked, the opposite of REG_ID_GIC
+#define REG_INT_STATUS		0x46 // same as REG_ID_GIN
+#define REG_OUTPUT_CONFIG	0x4F
+
+static struct
+{
+	uint8_t command;
+
+	// the pins only follow it while they're outputs, like on the real chip
+	uint8_t output;
+	uint8_t polarity;
+
+	// stored, but the pads aren't configured from them
+	uint8_t drive[2];
+	uint8_t input_latch;
+	uint8_t output_config;
+} self =
+{
+	.output = 0xFF,
+	.drive = { 0xFF, 0xFF },
+};
+
+static uint8_t read_register(uint8_t reg)
+{
+	switch (reg) {
+	case REG_INPUT:			return gpioexp_get_value() ^ self.polarity;
+	case REG_OUTPUT:		return self.output;
+	case REG_POLARITY:		return self.polarity;
+	case REG_CONFIG:		return reg_get_value(REG_ID_DIR);
+	case REG_DRIVE_0:		return self.drive[0];
+	case REG_DRIVE_1:		return self.drive[1];
+	case REG_INPUT_LATCH:	return self.input_latch;
+	case REG_PULL_ENABLE:	return reg_get_value(REG_ID_PUE);
+	case REG_PULL_SELECT:	return reg_get_value(REG_ID_PUD);
+	case REG_INT_MASK:		return ~reg_get_value(REG_ID_GIC);
+	case REG_INT_STATUS:	return reg_get_value(REG_ID_GIN);
+	case REG_OUTPUT_CONFIG:	return self.output_config;
+	}
+
+	return 0xFF;
+}
+
+static void write_register(uint8_t reg, uint8_t value)
+{
+	switch (reg) {
+	case REG_OUTPUT:
+		self.output = value;
+		gpioexp_set_value(self.output);
+		break;
+
+	case REG_POLARITY:
+		self.polarity = value;
+		break;
+
+	case REG_CONFIG:
+		gpioexp_update_dir(value);
+
+		// pins that just became outputs drive the output register right away
+		gpioexp_set_value(self.output);
+		break;
+
+	case REG_DRIVE_0:
+	case REG_DRIVE_1:
+		self.drive[reg - REG_DRIVE_0] = value;
+		break;
+
+	case REG_INPUT_LATCH:
+		self.input_latch = value;
+		break;
+
+	case REG_PULL_ENABLE:
+		gpioexp_update_pue_pud(value, reg_get_value(REG_ID_PUD));
+		break;
+
+	case REG_PULL_SELECT:
+		gpioexp_update_pue_pud(reg_get_value(REG_ID_PUE), value);
+		break;
+
+	case REG_INT_MASK:
+		reg_set_value(REG_ID_GIC, ~value);
+		break;
+
+	case REG_OUTPUT_CONFIG:
+		self.output_config = value;
+		break;
+
+	// read-only
+	default:
+		break;
+	}
+}
+
+// reading the inputs acknowledges the interrupt, for the register map as well
+static void clear_interrupt(void)
+{
+	reg_set_value(REG_ID_GIN, 0);
+	reg_clear_bit(REG_ID_INT, INT_GPIO);
+
+	interrupt_sync();
+}
+
+static void gpioexp_receive(const uint8_t *data, uint8_t len)
+{
+	if (len == 0)
+		return;
+
+	self.command = data[0];
+
+	// no auto-increment, every byte goes to the same register
+	for (uint8_t i = 1; i < len; ++i)
+		write_register(self.command, data[i]);
+}
+
+static uint8_t gpioexp_request(uint8_t *data, uint8_t size)
+{
+	// a longer read keeps returning the same register
+	memset(data, read_register(self.command), size);
+
+	return size;
+}
+
+static void gpioexp_sent(uint8_t len)
+{
+	if ((len > 0) && (self.command == REG_INPUT))
+		clear_interrupt();
+}
+
+static const struct pio_i2c_target_handler handler =
+{
+	.receive = gpioexp_receive,
+	.request = gpioexp_request,
+	.sent = gpioexp_sent,
+};
+
+const struct pio_i2c_target_handler *gpioexp_i2c_get_handler(void)
+{
+	return &handler;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "pio_i2c_target.h"
+
+// where a PCAL6408 answers with its ADDR pin low
+#define GPIOEXP_I2C_ADDRESS		0x20
+
+// PCAL6408 compatible view of the GPIO expander, see PUPPET_I2C_GPIO in the board file
+const struct pio_i2c_target_handler *gpioexp_i2c_get_handler(void);
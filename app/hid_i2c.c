@@ -0,0 +1,448 @@
+#include "hid_i2c.h"
+
+#include "app_config.h"
+#include "keyboard.h"
+#include "reg.h"
+#include "touchpad.h"
+
+#include <hardware/sync.h>
+#include <pico/stdlib.h>
+#include <string.h>
+#include <tusb.h>
+
+// Registers as seen by the host, 16 bit little endian, the HID descriptor one goes into the device tree
+#define REG_HID_DESC		0x0001
+#define REG_REPORT_DESC		0x0002
+#define REG_INPUT			0x0003
+#define REG_OUTPUT			0x0004
+#define REG_COMMAND			0x0005
+#define REG_DATA			0x0006
+
+#define OPCODE_RESET		0x1
+#define OPCODE_GET_REPORT	0x2
+#define OPCODE_SET_REPORT	0x3
+#define OPCODE_GET_IDLE		0x4
+#define OPCODE_SET_IDLE		0x5
+#define OPCODE_GET_PROTOCOL	0x6
+#define OPCODE_SET_PROTOCOL	0x7
+#define OPCODE_SET_POWER	0x8
+
+#define POWER_SLEEP			0x1
+
+#define REPORT_ID_KEYBOARD	1
+#define REPORT_ID_MOUSE		2
+
+// length prefix, report ID and the largest report
+#define MAX_INPUT_LEN		(2 + 1 + sizeof(hid_keyboard_report_t))
+
+// length prefix, report ID and the keyboard LEDs
+#define MAX_OUTPUT_LEN		(2 + 1 + 1)
+
+// input reports waiting for the host, INT is held low while there are any
+#define QUEUE_SIZE			16
+
+// the same reports as over USB, told apart by their ID since they share the input register
+static const uint8_t report_descriptor[] =
+{
+	TUD_HID_REPORT_DESC_KEYBOARD(HID_REPORT_ID(REPORT_ID_KEYBOARD)),
+	TUD_HID_REPORT_DESC_MOUSE(HID_REPORT_ID(REPORT_ID_MOUSE)),
+};
+
+_Static_assert(sizeof(report_descriptor) <= PIO_I2C_TARGET_BUFFER_SIZE, "report descriptor doesn't fit a single read");
+
+struct TU_ATTR_PACKED hid_descriptor
+{
+	uint16_t wHIDDescLength;
+	uint16_t bcdVersion;
+	uint16_t wReportDescLength;
+	uint16_t wReportDescRegister;
+	uint16_t wInputRegister;
+	uint16_t wMaxInputLength;
+	uint16_t wOutputRegister;
+	uint16_t wMaxOutputLength;
+	uint16_t wCommandRegister;
+	uint16_t wDataRegister;
+	uint16_t wVendorID;
+	uint16_t wProductID;
+	uint16_t wVersionID;
+	uint32_t reserved;
+};
+
+static const struct hid_descriptor hid_descriptor =
+{
+	.wHIDDescLength			= sizeof(struct hid_descriptor),
+	.bcdVersion				= 0x0100,
+	.wReportDescLength		= sizeof(report_descriptor),
+	.wReportDescRegister	= REG_REPORT_DESC,
+	.wInputRegister			= REG_INPUT,
+	.wMaxInputLength		= MAX_INPUT_LEN,
+	.wOutputRegister		= REG_OUTPUT,
+	.wMaxOutputLength		= MAX_OUTPUT_LEN,
+	.wCommandRegister		= REG_COMMAND,
+	.wDataRegister			= REG_DATA,
+	.wVendorID				= USB_VID,
+	.wProductID				= USB_PID,
+	.wVersionID				= VER_VAL,
+};
+
+struct input_report
+{
+	uint8_t len;
+	uint8_t data[MAX_INPUT_LEN];
+};
+
+static struct
+{
+	struct input_report queue[QUEUE_SIZE];
+	uint8_t count;
+	uint8_t read_idx;
+
+	// what the host is about to read, a register it selected or the next input report
+	const uint8_t *read_data;
+	uint8_t read_len;
+	bool reading_input;
+
+	// the report at read_idx is being clocked out, it stays where it is until hid_sent()
+	bool report_in_flight;
+
+	// answer to a GET_* command, read from the data register
+	uint8_t response[MAX_INPUT_LEN];
+
+	bool reset_pending;
+	bool asleep;
+
+	hid_keyboard_report_t keyboard;
+	uint8_t mouse_btn;
+	bool mouse_moved;
+} self;
+
+static void sync_int(void)
+{
+	const bool pending = !self.asleep && (self.reset_pending || (self.count > 0));
+
+	gpio_put(PIN_INT, !pending);
+}
+
+// returns the length of the input report, prefix included
+static uint8_t put_report(uint8_t *out, uint8_t id, const void *report, uint8_t size)
+{
+	const uint8_t len = 2 + 1 + size;
+
+	out[0] = len;
+	out[1] = 0;
+	out[2] = id;
+
+	if (size > 0)
+		memcpy(&out[3], report, size);
+
+	return len;
+}
+
+static void queue_report(uint8_t id, const void *report, uint8_t size)
+{
+	if (self.asleep)
+		return;
+
+	const uint32_t irq_status = save_and_disable_interrupts();
+
+	// the host is too slow, the oldest report goes, or the newest one if the oldest is being read
+	if (self.count == QUEUE_SIZE) {
+		if (!self.report_in_flight)
+			self.read_idx = (self.read_idx + 1) % QUEUE_SIZE;
+
+		self.count--;
+	}
+
+	struct input_report *entry = &self.queue[(self.read_idx + self.count) % QUEUE_SIZE];
+	entry->len = put_report(entry->data, id, report, size);
+	self.count++;
+
+	restore_interrupts(irq_status);
+
+	sync_int();
+}
+
+static void flush_reports(void)
+{
+	const uint32_t irq_status = save_and_disable_interrupts();
+
+	self.count = 0;
+	self.read_idx = 0;
+	self.report_in_flight = false;
+
+	restore_interrupts(irq_status);
+}
+
+static void queue_mouse(int8_t x, int8_t y)
+{
+	const uint32_t irq_status = save_and_disable_interrupts();
+
+	// motion piles up in the last report while the host is behind, the first one may already be on its way out
+	if (self.count > 1) {
+		struct input_report *last = &self.queue[(self.read_idx + self.count - 1) % QUEUE_SIZE];
+		hid_mouse_report_t *pending = (hid_mouse_report_t *)&last->data[3];
+
+		const int16_t dx = pending->x + x;
+		const int16_t dy = pending->y + y;
+
+		if ((last->data[2] == REPORT_ID_MOUSE) && (pending->buttons == self.mouse_btn) &&
+			(dx >= INT8_MIN) && (dx <= INT8_MAX) && (dy >= INT8_MIN) && (dy <= INT8_MAX)) {
+			pending->x = dx;
+			pending->y = dy;
+
+			restore_interrupts(irq_status);
+			return;
+		}
+	}
+
+	restore_interrupts(irq_status);
+
+	const hid_mouse_report_t report = { .buttons = self.mouse_btn, .x = x, .y = y };
+
+	queue_report(REPORT_ID_MOUSE, &report, sizeof(report));
+}
+
+static void update_keyboard(uint8_t key, bool pressed)
+{
+	// modifiers are the 0xE0-0xE7 usages, they have their own byte
+	if ((key >= KEY_LEFTCTRL) && (key <= KEY_RIGHTMETA)) {
+		const uint8_t bit = 1 << (key - KEY_LEFTCTRL);
+
+		if (pressed)
+			self.keyboard.modifier |= bit;
+		else
+			self.keyboard.modifier &= ~bit;
+
+		return;
+	}
+
+	for (uint8_t i = 0; i < sizeof(self.keyboard.keycode); ++i) {
+		if (pressed && (self.keyboard.keycode[i] == 0)) {
+			self.keyboard.keycode[i] = key;
+			return;
+		}
+
+		if (!pressed && (self.keyboard.keycode[i] == key))
+			self.keyboard.keycode[i] = 0;
+	}
+}
+
+static void key_cb(uint8_t key, enum key_state state)
+{
+	if ((state != KEY_STATE_PRESSED) && (state != KEY_STATE_RELEASED)) {
+		// holding the trackpad button without moving is a right click, same as over USB
+		if ((key == KEY_COMPOSE) && (state == KEY_STATE_HOLD) && !self.mouse_moved) {
+			self.mouse_btn = MOUSE_BUTTON_RIGHT;
+			queue_mouse(0, 0);
+		}
+		return;
+	}
+
+	if (key == KEY_COMPOSE) {
+		self.mouse_btn = (state == KEY_STATE_PRESSED) ? MOUSE_BUTTON_LEFT : 0x00;
+		self.mouse_moved = false;
+		queue_mouse(0, 0);
+		return;
+	}
+
+	// the power key is handled by the firmware
+	if (key == KEY_POWER)
+		return;
+
+	update_keyboard(key, state == KEY_STATE_PRESSED);
+
+	queue_report(REPORT_ID_KEYBOARD, &self.keyboard, sizeof(self.keyboard));
+}
+static struct key_callback key_callback = { .func = key_cb };
+
+static void touch_cb(int8_t x, int8_t y)
+{
+	self.mouse_moved = true;
+
+	queue_mouse(x, y);
+}
+static struct touch_callback touch_callback = { .func = touch_cb };
+
+static uint8_t get_report(uint8_t type, uint8_t id)
+{
+	// there are no feature reports, an empty one is still a valid answer
+	if (type != HID_REPORT_TYPE_INPUT)
+		return put_report(self.response, id, NULL, 0);
+
+	if (id == REPORT_ID_KEYBOARD)
+		return put_report(self.response, id, &self.keyboard, sizeof(self.keyboard));
+
+	const hid_mouse_report_t report = { .buttons = self.mouse_btn };
+
+	return put_report(self.response, REPORT_ID_MOUSE, &report, sizeof(report));
+}
+
+// data[0] is the report type and ID, data[1] the opcode, see the spec for the rest
+static void handle_command(const uint8_t *data, uint8_t len)
+{
+	if (len < 2)
+		return;
+
+	const uint8_t type = (data[0] >> 4) & 0x03;
+	const uint8_t opcode = data[1] & 0x0F;
+	uint8_t id = data[0] & 0x0F;
+
+	// IDs of 15 and above follow as a third byte
+	if ((id == 0x0F) && (len > 2))
+		id = data[2];
+
+	switch (opcode) {
+	case OPCODE_RESET:
+		flush_reports();
+		memset(&self.keyboard, 0, sizeof(self.keyboard));
+		self.mouse_btn = 0x00;
+		self.asleep = false;
+
+		// acknowledged by an input report of length 0
+		self.reset_pending = true;
+		break;
+
+	case OPCODE_GET_REPORT:
+		self.read_data = self.response;
+		self.read_len = get_report(type, id);
+		break;
+
+	case OPCODE_GET_IDLE:
+	case OPCODE_GET_PROTOCOL:
+	{
+		// no idle rate, always the report protocol
+		const uint16_t value = (opcode == OPCODE_GET_PROTOCOL) ? 1 : 0;
+
+		self.response[0] = 4;
+		self.response[1] = 0;
+		self.response[2] = (uint8_t)(value & 0xFF);
+		self.response[3] = (uint8_t)(value >> 8);
+
+		self.read_data = self.response;
+		self.read_len = 4;
+		break;
+	}
+
+	case OPCODE_SET_POWER:
+		self.asleep = ((data[0] & 0x03) == POWER_SLEEP);
+
+		if (self.asleep)
+			flush_reports();
+		break;
+
+	// nothing to set, the LEDs aren't implemented (same as over USB) and neither is idle
+	case OPCODE_SET_REPORT:
+	case OPCODE_SET_IDLE:
+	case OPCODE_SET_PROTOCOL:
+	default:
+		break;
+	}
+
+	sync_int();
+}
+
+static void hid_receive(const uint8_t *data, uint8_t len)
+{
+	if (len < 2)
+		return;
+
+	const uint16_t reg = data[0] | (data[1] << 8);
+
+	self.read_data = NULL;
+	self.read_len = 0;
+
+	switch (reg) {
+	case REG_HID_DESC:
+		self.read_data = (const uint8_t *)&hid_descriptor;
+		self.read_len = sizeof(hid_descriptor);
+		break;
+
+	case REG_REPORT_DESC:
+		self.read_data = report_descriptor;
+		self.read_len = sizeof(report_descriptor);
+		break;
+
+	case REG_COMMAND:
+		handle_command(&data[2], len - 2);
+		break;
+
+	// output reports (the keyboard LEDs) and reads of the input register are handled like a plain read
+	default:
+		break;
+	}
+}
+
+static uint8_t hid_request(uint8_t *data, uint8_t size)
+{
+	uint8_t len = 0;
+
+	self.reading_input = (self.read_data == NULL);
+
+	if (!self.reading_input) {
+		len = MIN(self.read_len, size);
+		memcpy(data, self.read_data, len);
+	} else if (self.reset_pending || (self.count == 0)) {
+		// length 0, either the reset acknowledgement or there's nothing to report
+		data[0] = 0;
+		data[1] = 0;
+		len = 2;
+	} else {
+		const struct input_report *entry = &self.queue[self.read_idx];
+
+		len = MIN(entry->len, size);
+		memcpy(data, entry->data, len);
+
+		self.report_in_flight = true;
+	}
+
+	return len;
+}
+
+static void hid_sent(uint8_t len)
+{
+	// a register is only read once, the next plain read is for an input report again
+	if (!self.reading_input) {
+		self.read_data = NULL;
+		return;
+	}
+
+	if (self.reset_pending) {
+		if (len >= 2)
+			self.reset_pending = false;
+	} else {
+		const uint32_t irq_status = save_and_disable_interrupts();
+
+		// only gone once the host got all of it, unless a reset flushed it in the meantime
+		if (self.report_in_flight && (len >= self.queue[self.read_idx].len)) {
+			self.read_idx = (self.read_idx + 1) % QUEUE_SIZE;
+			self.count--;
+		}
+
+		self.report_in_flight = false;
+
+		restore_interrupts(irq_status);
+	}
+
+	sync_int();
+}
+
+static const struct pio_i2c_target_handler handler =
+{
+	.receive = hid_receive,
+	.request = hid_request,
+	.sent = hid_sent,
+};
+
+const struct pio_i2c_target_handler *hid_i2c_get_handler(void)
+{
+	return &handler;
+}
+
+void hid_i2c_init(void)
+{
+	keyboard_add_key_callback(&key_callback);
+
+	touchpad_add_touch_callback(&touch_callback);
+
+	sync_int();
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "pio_i2c_target.h"
+
+// HID over I2C personality of the puppet, see PUPPET_I2C_HID in the board file
+const struct pio_i2c_target_handler *hid_i2c_get_handler(void);
+
+void hid_i2c_init(void);
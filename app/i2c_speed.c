@@ -0,0 +1,76 @@
+#include "i2c_speed.h"
+
+#include <hardware/clocks.h>
+#include <pico/stdlib.h>
+
+// Timings from the I2C-bus specification (UM10204), in ns
+struct speed_timing
+{
+	uint baudrate;
+	uint spike_ns;		// tSP, longest spike that has to be suppressed
+	uint hold_ns;		// tHD;DAT we give ourselves when driving SDA
+	uint setup_ns;		// tSU;DAT, only used when transmitting as a target
+};
+
+static const struct speed_timing timings[] =
+{
+	[I2C_SPEED_STANDARD]	= { .baudrate = 100 * 1000,  .spike_ns = 50, .hold_ns = 300, .setup_ns = 250 },
+	[I2C_SPEED_FAST]		= { .baudrate = 400 * 1000,  .spike_ns = 50, .hold_ns = 300, .setup_ns = 100 },
+	[I2C_SPEED_FAST_PLUS]	= { .baudrate = 1000 * 1000, .spike_ns = 50, .hold_ns = 120, .setup_ns = 50 },
+};
+
+static uint ns_to_cycles(uint32_t freq_in, uint ns, bool round_up)
+{
+	return (uint)(((uint64_t)freq_in * ns + (round_up ? 999999999 : 0)) / 1000000000);
+}
+
+uint i2c_speed_to_baudrate(enum i2c_speed speed)
+{
+	if (speed > I2C_SPEED_FAST_PLUS)
+		speed = I2C_SPEED_FAST_PLUS;
+
+	return timings[speed].baudrate;
+}
+
+void i2c_speed_apply(i2c_inst_t *i2c, uint sda, uint scl, enum i2c_speed speed)
+{
+	if (speed > I2C_SPEED_FAST_PLUS)
+		speed = I2C_SPEED_FAST_PLUS;
+
+	const struct speed_timing *timing = &timings[speed];
+	const uint32_t freq_in = clock_get_hz(clk_sys);
+
+	// takes care of the SCL high/low counts in controller mode
+	i2c_set_baudrate(i2c, timing->baudrate);
+
+	// the SDK derives the spike filter from the SCL low count, which is too long in FM and
+	// doesn't apply in target mode at all, so set everything explicitly
+	i2c->hw->enable = 0;
+
+	// spikes are filtered up to the limit, the hold and setup times are minimums (+1 like the SDK does)
+	i2c->hw->fs_spklen = MAX(ns_to_cycles(freq_in, timing->spike_ns, false), 1);
+	hw_write_masked(&i2c->hw->sda_hold,
+		(ns_to_cycles(freq_in, timing->hold_ns, true) + 1) << I2C_IC_SDA_HOLD_IC_SDA_TX_HOLD_LSB,
+		I2C_IC_SDA_HOLD_IC_SDA_TX_HOLD_BITS);
+	i2c->hw->sda_setup = MIN(ns_to_cycles(freq_in, timing->setup_ns, true) + 1, 0xFF);
+
+	i2c->hw->enable = 1;
+
+	i2c_speed_apply_pads(sda, scl, speed);
+}
+
+void i2c_speed_apply_pads(uint sda, uint scl, enum i2c_speed speed)
+{
+	// FM+ needs to sink up to 20mA and have fast edges to make the 1 MHz rise times
+	const enum gpio_drive_strength drive = (speed == I2C_SPEED_FAST_PLUS)
+		? GPIO_DRIVE_STRENGTH_12MA
+		: GPIO_DRIVE_STRENGTH_4MA;
+	const enum gpio_slew_rate slew = (speed == I2C_SPEED_FAST_PLUS)
+		? GPIO_SLEW_RATE_FAST
+		: GPIO_SLEW_RATE_SLOW;
+
+	gpio_set_drive_strength(sda, drive);
+	gpio_set_drive_strength(scl, drive);
+	gpio_set_slew_rate(sda, slew);
+	gpio_set_slew_rate(scl, slew);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <hardware/i2c.h>
+
+enum i2c_speed
+{
+	I2C_SPEED_STANDARD = 0,		// 100 kHz
+	I2C_SPEED_FAST = 1,			// 400 kHz
+	I2C_SPEED_FAST_PLUS = 2,	// 1 MHz
+};
+
+uint i2c_speed_to_baudrate(enum i2c_speed speed);
+
+// Set the bus speed and the spike filter/hold/setup timings that go with it, works in both modes
+void i2c_speed_apply(i2c_inst_t *i2c, uint sda, uint scl, enum i2c_speed speed);
+
+// Only the pad drive strength and slew rate, for targets that don't run on the I2C block
+void i2c_speed_apply_pads(uint sda, uint scl, enum i2c_speed speed);
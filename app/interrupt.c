@@ -3,11 +3,223 @@
 #include "app_config.h"
 #include "gpioexp.h"
 #include "keyboard.h"
+#include "puppet_i2c.h"
 #include "reg.h"
 #include "touchpad.h"
 
+#include <hardware/sync.h>
 #include <pico/stdlib.h>
 
+// a Host Notify that can't get through is retried with a doubling delay, then dropped
+#define NOTIFY_ATTEMPTS		6
+#define NOTIFY_BACKOFF_US	500
+
+static struct
+{
+	alarm_id_t alarm;
+	alarm_id_t release_alarm;
+
+	// a Host Notify is on the bus or waiting for a retry, how many times it was tried,
+	// and whether events came in after the status it carries was read
+	bool notifying;
+	bool notify_again;
+	uint8_t notify_attempts;
+
+	absolute_time_t last_pulse;
+	absolute_time_t first_pending;
+
+	// events since the last pulse
+	uint8_t pending;
+} self;
+
+static int64_t release_callback(alarm_id_t id, void *user_data)
+{
+	(void)id;
+	(void)user_data;
+
+	self.release_alarm = 0;
+
+	interrupt_sync();
+
+	return 0;
+}
+
+static int64_t notify_callback(alarm_id_t id, void *user_data);
+
+static void retry_notify(void)
+{
+	if (++self.notify_attempts >= NOTIFY_ATTEMPTS) {
+		self.notifying = false;
+		self.notify_again = false;
+		return;
+	}
+
+	// the jitter keeps two devices that collided from colliding again
+	const uint32_t backoff = (NOTIFY_BACKOFF_US << self.notify_attempts) + (time_us_32() % NOTIFY_BACKOFF_US);
+
+	if (add_alarm_in_us(backoff, notify_callback, NULL, true) < 0)
+		self.notifying = false;
+}
+
+static void notify(void)
+{
+	// notify_done() runs from the I2C irq, it must not slip in between the check and the set
+	const uint32_t irq_status = save_and_disable_interrupts();
+
+	// merged into the pending one, its attempts and back-off carry on
+	if (self.notifying) {
+		self.notify_again = true;
+		restore_interrupts(irq_status);
+		return;
+	}
+
+	self.notifying = true;
+	self.notify_attempts = 0;
+
+	restore_interrupts(irq_status);
+
+	if (add_alarm_in_us(0, notify_callback, NULL, true) < 0)
+		self.notifying = false;
+}
+
+static void notify_done(bool sent)
+{
+	if (!sent) {
+		retry_notify();
+		return;
+	}
+
+	self.notifying = false;
+
+	// what came in while it was on the bus wasn't in it
+	if (self.notify_again) {
+		self.notify_again = false;
+		notify();
+	}
+}
+
+static int64_t notify_callback(alarm_id_t id, void *user_data)
+{
+	(void)id;
+	(void)user_data;
+
+	// always the current status, events that came in during the back-off ride along
+	const uint16_t status = reg_get_value(REG_ID_INT) | (reg_get_value(REG_ID_IN2) << 8);
+
+	self.notify_again = false;
+
+	// the bus is busy
+	if (!puppet_i2c_host_notify(status, notify_done))
+		retry_notify();
+
+	return 0;
+}
+
+static void pulse(void)
+{
+#ifdef PUPPET_I2C_HID
+	// PIN_INT signals pending input reports instead, see hid_i2c.c
+	return;
+#endif
+
+	if (reg_is_bit_set(REG_ID_CF2, CF2_HOST_NOTIFY)) {
+		notify();
+		return;
+	}
+
+	gpio_put(PIN_INT, 0);
+
+	// held until the host clears REG_INT, see interrupt_sync()
+	if (reg_is_bit_set(REG_ID_CF2, CF2_INT_LEVEL))
+		return;
+
+	if (self.release_alarm)
+		cancel_alarm(self.release_alarm);
+
+	self.release_alarm = add_alarm_in_ms(reg_get_value(REG_ID_IND), release_callback, NULL, true);
+}
+
+static int64_t alarm_callback(alarm_id_t id, void *user_data);
+
+// Pulse now if the pending events are due, otherwise make sure we're woken up once they are.
+// Enough events are due once the gap since the last pulse is over, fewer once the hold-off is too.
+static void evaluate(void)
+{
+	if (self.pending == 0)
+		return;
+
+	// the previous pulse has to be over for the next one to be an edge
+	const uint32_t gap = MAX(reg_get_value(REG_ID_ICG), reg_get_value(REG_ID_IND) + 1);
+	absolute_time_t due = delayed_by_ms(self.last_pulse, gap);
+
+	if (self.pending < MAX(reg_get_value(REG_ID_ICT), 1)) {
+		const absolute_time_t held = delayed_by_ms(self.first_pending, reg_get_value(REG_ID_ICH));
+
+		if (absolute_time_diff_us(due, held) > 0)
+			due = held;
+	}
+
+	if (self.alarm) {
+		cancel_alarm(self.alarm);
+		self.alarm = 0;
+	}
+
+	if (absolute_time_diff_us(get_absolute_time(), due) > 0) {
+		self.alarm = add_alarm_at(due, alarm_callback, NULL, true);
+		return;
+	}
+
+	self.pending = 0;
+	self.last_pulse = get_absolute_time();
+
+	pulse();
+}
+
+static int64_t alarm_callback(alarm_id_t id, void *user_data)
+{
+	(void)id;
+	(void)user_data;
+
+	self.alarm = 0;
+
+	evaluate();
+
+	return 0;
+}
+
+void interrupt_sync(void)
+{
+#ifdef PUPPET_I2C_HID
+	return;
+#endif
+
+	// INT isn't used at all while notifying the host over the bus
+	if (reg_is_bit_set(REG_ID_CF2, CF2_HOST_NOTIFY)) {
+		gpio_put(PIN_INT, 1);
+		return;
+	}
+
+	// in level mode INT simply follows REG_INT
+	if (reg_is_bit_set(REG_ID_CF2, CF2_INT_LEVEL)) {
+		gpio_put(PIN_INT, reg_get_value(REG_ID_INT) == 0);
+		return;
+	}
+
+	if (!self.release_alarm)
+		gpio_put(PIN_INT, 1);
+}
+
+void interrupt_trigger(void)
+{
+	if (self.pending == 0)
+		self.first_pending = get_absolute_time();
+
+	if (self.pending < UINT8_MAX)
+		self.pending++;
+
+	evaluate();
+}
+
 static void key_cb(uint8_t key, enum key_state state)
 {
 	(void)key;
@@ -18,9 +230,7 @@ static void key_cb(uint8_t key, enum key_state state)
 
 	reg_set_bit(REG_ID_INT, INT_KEY);
 
-	gpio_put(PIN_INT, 0);
-	busy_wait_ms(reg_get_value(REG_ID_IND));
-	gpio_put(PIN_INT, 1);
+	interrupt_trigger();
 }
 static struct key_callback key_callback = { .func = key_cb };
 
@@ -38,11 +248,8 @@ static void key_lock_cb(bool caps_changed, bool num_changed)
 		do_int = true;
 	}
 
-	if (do_int) {
-		gpio_put(PIN_INT, 0);
-		busy_wait_ms(reg_get_value(REG_ID_IND));
-		gpio_put(PIN_INT, 1);
-	}
+	if (do_int)
+		interrupt_trigger();
 }
 
 static void touch_cb(int8_t x, int8_t y)
@@ -55,9 +262,7 @@ static void touch_cb(int8_t x, int8_t y)
 
 	reg_set_bit(REG_ID_INT, INT_TOUCH);
 
-	gpio_put(PIN_INT, 0);
-	busy_wait_ms(reg_get_value(REG_ID_IND));
-	gpio_put(PIN_INT, 1);
+	interrupt_trigger();
 }
 static struct touch_callback touch_callback = { .func = touch_cb };
 
@@ -71,9 +276,7 @@ static void gpioexp_cb(uint8_t gpio, uint8_t gpio_idx)
 	reg_set_bit(REG_ID_INT, INT_GPIO);
 	reg_set_bit(REG_ID_GIN, (1 << gpio_idx));
 
-	gpio_put(PIN_INT, 0);
-	busy_wait_ms(reg_get_value(REG_ID_IND));
-	gpio_put(PIN_INT, 1);
+	interrupt_trigger();
 }
 static struct gpioexp_callback gpioexp_callback = { .func = gpioexp_cb };
 
@@ -1,3 +1,9 @@
 #pragma once
 
+// Signal the host on PIN_INT, coalesced according to REG_ICG, REG_ICT and REG_ICH
+void interrupt_trigger(void);
+
+// Pick up REG_INT and REG_CF2 changes, releases INT in level mode once REG_INT is cleared
+void interrupt_sync(void);
+
 void interrupt_init(void);
@@ -0,0 +1,91 @@
+#include "key_ring.h"
+
+#include <hardware/sync.h>
+#include <pico/stdlib.h>
+
+// Events kept for the slowest reader, a power of two so indexing is a mask
+#define KEY_RING_SLOTS		64
+#define KEY_RING_MASK		(KEY_RING_SLOTS - 1)
+
+_Static_assert((KEY_RING_SLOTS & KEY_RING_MASK) == 0, "KEY_RING_SLOTS has to be a power of two");
+
+// The producer never waits for a reader, it overwrites what the slowest one hasn't read yet. Readers
+// look at their cursor and copy the event with interrupts off, so they can't catch a half written one.
+static struct
+{
+	struct fifo_item items[KEY_RING_SLOTS];
+	volatile uint16_t head;
+
+	uint16_t cursors[KEY_RING_READERS];
+	struct key_ring_stats stats[KEY_RING_READERS];
+} self;
+
+void key_ring_push(const struct fifo_item *item)
+{
+	const uint32_t irq = save_and_disable_interrupts();
+
+	self.items[self.head & KEY_RING_MASK] = *item;
+	self.head++;
+
+	restore_interrupts(irq);
+}
+
+// interrupts have to be off
+static void catch_up(enum key_ring_reader reader)
+{
+	const uint16_t behind = self.head - self.cursors[reader];
+
+	if (behind <= KEY_RING_SLOTS)
+		return;
+
+	self.stats[reader].lost += behind - KEY_RING_SLOTS;
+	self.cursors[reader] = self.head - KEY_RING_SLOTS;
+}
+
+bool key_ring_peek(enum key_ring_reader reader, struct fifo_item *item)
+{
+	const uint32_t irq = save_and_disable_interrupts();
+
+	catch_up(reader);
+
+	const bool available = (self.head != self.cursors[reader]);
+
+	if (available)
+		*item = self.items[self.cursors[reader] & KEY_RING_MASK];
+
+	restore_interrupts(irq);
+
+	return available;
+}
+
+void key_ring_skip(enum key_ring_reader reader)
+{
+	const uint32_t irq = save_and_disable_interrupts();
+
+	const uint16_t behind = self.head - self.cursors[reader];
+
+	// the peeked event was overwritten since, catching up counts it as lost
+	if (behind > KEY_RING_SLOTS) {
+		catch_up(reader);
+	} else if (behind > 0) {
+		self.cursors[reader]++;
+		self.stats[reader].read++;
+	}
+
+	restore_interrupts(irq);
+}
+
+const struct key_ring_stats *key_ring_get_stats(enum key_ring_reader reader)
+{
+	return &self.stats[reader];
+}
+
+void key_ring_reset_stats(void)
+{
+	const uint32_t irq = save_and_disable_interrupts();
+
+	for (uint8_t i = 0; i < KEY_RING_READERS; ++i)
+		self.stats[i] = (struct key_ring_stats){ 0 };
+
+	restore_interrupts(irq);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "fifo.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Consumers of the key events that read them at their own pace, each with its own cursor.
+// The I2C host keeps reading REG_ID_FIF, that FIFO has a depth and an overflow policy of its own.
+enum key_ring_reader
+{
+	KEY_RING_USB_HID = 0,
+	KEY_RING_USB_VENDOR,	// streamed with CF2_USB_MATRIX
+#ifndef NDEBUG
+	KEY_RING_DEBUG,			// only debug builds print the keys, a release one would just lose them
+#endif
+
+	KEY_RING_READERS,
+};
+
+// A REG_ID_KRS read is these for every reader, in enum key_ring_reader order
+struct key_ring_stats
+{
+	uint32_t read;
+	uint32_t lost; // overwritten before the reader got to them
+};
+
+void key_ring_push(const struct fifo_item *item);
+
+// The oldest event the reader hasn't seen, false if there's none
+bool key_ring_peek(enum key_ring_reader reader, struct fifo_item *item);
+
+// Done with the event key_ring_peek() returned
+void key_ring_skip(enum key_ring_reader reader);
+
+const struct key_ring_stats *key_ring_get_stats(enum key_ring_reader reader);
+void key_ring_reset_stats(void);
@@ -1,17 +1,34 @@
 #include "app_config.h"
+#include "event.h"
 #include "fifo.h"
+#include "interrupt.h"
+#include "key_ring.h"
 #include "keyboard.h"
 #include "reg.h"
 #include "pi.h"
+#include "watch.h"
 
+#include <hardware/sync.h>
 #include <pico/stdlib.h>
 
 // Size of the list keeping track of all the pressed keys
 #define MAX_TRACKED_KEYS 10
 
+// Scans in a row with nothing down before the matrix is left to the row interrupts
+#define IDLE_AFTER_SCANS 10
+
+_Static_assert((NUM_OF_ROWS * NUM_OF_COLS) + NUM_OF_BTNS <= (KEYBOARD_MATRIX_LEN * 8), "the matrix doesn't fit REG_ID_MTX");
+
 static struct
 {
 	struct key_callback *key_callbacks;
+
+	// raw state of the last scan, before any of the key mapping
+	uint64_t matrix;
+
+	// not scanning, the columns are driven low and a row going low restarts it
+	volatile bool idle;
+	uint8_t idle_scans;
 } self;
 
 // Key and buttons definitions
@@ -173,6 +190,153 @@ static bool handle_hold_key_event(struct hold_key* hold_key, enum key_state* sta
 	return false;
 }
 
+static bool is_held(const struct hold_key *hold_key)
+{
+	return (hold_key->state == KEY_STATE_PRESSED)
+		|| (hold_key->state == KEY_STATE_HOLD)
+		|| (hold_key->state == KEY_STATE_LONG_HOLD);
+}
+
+static uint8_t held_mods(void)
+{
+	uint8_t mods = 0;
+
+	if (is_held(&left_shift_hold_key))
+		mods |= FIFO_MOD_SHL;
+
+	if (is_held(&right_shift_hold_key))
+		mods |= FIFO_MOD_SHR;
+
+	if (is_held(&phys_alt_hold_key))
+		mods |= FIFO_MOD_ALT;
+
+	if (is_held(&sym_hold_key))
+		mods |= FIFO_MOD_SYM;
+
+	return mods;
+}
+
+static void report_event(uint8_t key, enum key_state state, enum key_source source)
+{
+	struct fifo_item item;
+	item.scancode = key;
+	item.state = state;
+	item.mods = held_mods();
+	item.source = source;
+	item.time_us = time_us_32();
+
+	// three copies: the FIFO and the event queue have overflow rules the ring can't follow
+	event_push_key(key, state, item.mods, source);
+
+	key_ring_push(&item);
+
+	if (!fifo_enqueue(item)) {
+		if (reg_is_bit_set(REG_ID_CFG, CFG_OVERFLOW_INT)) {
+			reg_set_bit(REG_ID_INT, INT_OVERFLOW);
+		}
+
+		// a dropped release would leave the key stuck on the host
+		if (reg_is_bit_set(REG_ID_CFG, CFG_OVERFLOW_ON) || (state == KEY_STATE_RELEASED)) {
+			fifo_enqueue_force(item);
+		}
+	}
+
+	// once per fill, reg.c clears it again when the host drains below the watermark
+	const uint16_t watermark = fifo_get_watermark();
+
+	if (watermark && (fifo_count() >= watermark) && !reg_is_bit_set(REG_ID_IN2, IN2_FIFO_WM)) {
+		reg_set_bit(REG_ID_IN2, IN2_FIFO_WM);
+		reg_set_bit(REG_ID_INT, INT_IN2);
+
+		interrupt_trigger();
+	}
+
+	struct key_callback *cb = self.key_callbacks;
+	while (cb) {
+		cb->func(key, state);
+		cb = cb->next;
+	}
+}
+
+static bool hold_keys_idle(void)
+{
+	return (power_hold_key.state == KEY_STATE_IDLE)
+		&& (left_shift_hold_key.state == KEY_STATE_IDLE)
+		&& (right_shift_hold_key.state == KEY_STATE_IDLE)
+		&& (phys_alt_hold_key.state == KEY_STATE_IDLE)
+		&& (sym_hold_key.state == KEY_STATE_IDLE);
+}
+
+static bool rows_high(void)
+{
+	uint i;
+
+	for (i = 0; i < NUM_OF_ROWS; ++i) {
+		if (gpio_get(row_pins[i]) == 0)
+			return false;
+	}
+
+#if NUM_OF_BTNS > 0
+	for (i = 0; i < NUM_OF_BTNS; ++i) {
+		if (gpio_get(btn_pins[i]) == 0)
+			return false;
+	}
+#endif
+
+	return true;
+}
+
+static void set_wake_irqs(bool enabled)
+{
+	uint i;
+
+	for (i = 0; i < NUM_OF_ROWS; ++i)
+		gpio_set_irq_enabled(row_pins[i], GPIO_IRQ_EDGE_FALL, enabled);
+
+#if NUM_OF_BTNS > 0
+	for (i = 0; i < NUM_OF_BTNS; ++i)
+		gpio_set_irq_enabled(btn_pins[i], GPIO_IRQ_EDGE_FALL, enabled);
+#endif
+}
+
+static void leave_idle(void)
+{
+	uint i;
+
+	set_wake_irqs(false);
+
+	// where a scan leaves them
+	for (i = 0; i < NUM_OF_COLS; ++i) {
+		gpio_put(col_pins[i], 1);
+		gpio_set_dir(col_pins[i], GPIO_IN);
+	}
+
+	self.idle_scans = 0;
+	self.idle = false;
+}
+
+// With every column low, pressing any key pulls its row low. Returns false if one already did.
+static bool enter_idle(void)
+{
+	uint i;
+
+	for (i = 0; i < NUM_OF_COLS; ++i) {
+		gpio_put(col_pins[i], 0);
+		gpio_set_dir(col_pins[i], GPIO_OUT);
+	}
+
+	self.idle = true;
+	set_wake_irqs(true);
+
+	// a key that went down before the interrupts were armed made no edge to wake on
+	if (!rows_high()) {
+		leave_idle();
+		return false;
+	}
+
+	return true;
+}
+
 static void handle_key_event(uint r, uint c, bool pressed)
 {
 	uint8_t keycode;
@@ -191,8 +355,8 @@ static void handle_key_event(uint r, uint c, bool pressed)
 	if (keycode == left_shift_hold_key.keycode) {
 		send_update = handle_hold_key_event(&left_shift_hold_key, &state, pressed);
 
-	} else if (keycode == left_shift_hold_key.keycode) {
-		send_update = handle_hold_key_event(&left_shift_hold_key, &state, pressed);
+	} else if (keycode == right_shift_hold_key.keycode) {
+		send_update = handle_hold_key_event(&right_shift_hold_key, &state, pressed);
 
 	} else if (keycode == phys_alt_hold_key.keycode) {
 		send_update = handle_hold_key_event(&phys_alt_hold_key, &state, pressed);
@@ -213,7 +377,7 @@ static void handle_key_event(uint r, uint c, bool pressed)
 	}
 
 	// Report key to input system
-	keyboard_inject_event(keycode, state);
+	report_event(keycode, state, KEY_SOURCE_MATRIX);
 }
 
 static int64_t timer_task(alarm_id_t id, void *user_data)
@@ -222,6 +386,7 @@ static int64_t timer_task(alarm_id_t id, void *user_data)
 	(void)user_data;
 	uint c, r, i;
 	bool pressed;
+	uint64_t matrix = 0;
 
 	for (c = 0; c < NUM_OF_COLS; c++) {
 		gpio_pull_up(col_pins[c]);
@@ -231,6 +396,9 @@ static int64_t timer_task(alarm_id_t id, void *user_data)
 		for (r = 0; r < NUM_OF_ROWS; r++) {
 			pressed = (gpio_get(row_pins[r]) == 0);
 			handle_key_event(r, c, pressed);
+
+			if (pressed)
+				matrix |= (uint64_t)1 << ((r * NUM_OF_COLS) + c);
 		}
 
 		gpio_put(col_pins[c], 1);
@@ -242,34 +410,36 @@ static int64_t timer_task(alarm_id_t id, void *user_data)
 	for (i = 0; i < NUM_OF_BTNS; i++) {
 		pressed = (gpio_get(btn_pins[i]) == 0);
 		transition_hold_key_state(&power_hold_key, pressed);
+
+		if (pressed)
+			matrix |= (uint64_t)1 << ((NUM_OF_ROWS * NUM_OF_COLS) + i);
 	}
 #endif
 
+	if (matrix != self.matrix) {
+		// a 64 bit store isn't atomic, the I2C irq mustn't see half of it
+		const uint32_t irq = save_and_disable_interrupts();
+		self.matrix = matrix;
+		restore_interrupts(irq);
+
+		watch_mark(REG_ID_MTX);
+	}
+
+	if (matrix || !hold_keys_idle()) {
+		self.idle_scans = 0;
+	} else if (++self.idle_scans >= IDLE_AFTER_SCANS) {
+		// keyboard_gpio_irq() schedules the next scan
+		if (enter_idle())
+			return 0;
+	}
+
 	// negative value means interval since last alarm time
 	return -(reg_get_value(REG_ID_FRQ) * 1000);
 }
 
 void keyboard_inject_event(uint8_t key, enum key_state state)
 {
-	struct fifo_item item;
-	item.scancode = key;
-	item.state = state;
-
-	if (!fifo_enqueue(item)) {
-		if (reg_is_bit_set(REG_ID_CFG, CFG_OVERFLOW_INT)) {
-			reg_set_bit(REG_ID_INT, INT_OVERFLOW);
-		}
-
-		if (reg_is_bit_set(REG_ID_CFG, CFG_OVERFLOW_ON)) {
-			fifo_enqueue_force(item);
-		}
-	}
-
-	struct key_callback *cb = self.key_callbacks;
-	while (cb) {
-		cb->func(key, state);
-		cb = cb->next;
-	}
+	report_event(key, state, KEY_SOURCE_FIRMWARE);
 }
 
 // Simulate press event and schedule release
@@ -279,6 +449,40 @@ void keyboard_inject_power_key()
 	add_alarm_in_ms(10, release_power_key_alarm_callback, NULL, true);
 }
 
+uint64_t keyboard_get_matrix(void)
+{
+	const uint32_t irq = save_and_disable_interrupts();
+	const uint64_t matrix = self.matrix;
+	restore_interrupts(irq);
+
+	return matrix;
+}
+
+void keyboard_gpio_irq(uint gpio, uint32_t events)
+{
+	uint i;
+	bool ours = false;
+
+	if (!self.idle || !(events & GPIO_IRQ_EDGE_FALL))
+		return;
+
+	for (i = 0; i < NUM_OF_ROWS; ++i)
+		ours |= (gpio == row_pins[i]);
+
+#if NUM_OF_BTNS > 0
+	for (i = 0; i < NUM_OF_BTNS; ++i)
+		ours |= (gpio == btn_pins[i]);
+#endif
+
+	if (!ours)
+		return;
+
+	leave_idle();
+
+	// the key is down already, scan right away instead of a poll interval later
+	add_alarm_in_us(0, timer_task, NULL, true);
+}
+
 void keyboard_add_key_callback(struct key_callback *callback)
 {
 	// first callback
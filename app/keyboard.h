@@ -4,6 +4,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 enum key_state
 {
@@ -16,6 +17,16 @@ enum key_state
 
 #define LONG_HOLD_MS    5000
 
+// Where a key event came from
+enum key_source
+{
+	KEY_SOURCE_MATRIX = 0,	// the key matrix was scanned
+	KEY_SOURCE_FIRMWARE = 1,	// generated by the firmware, like the power key
+};
+
+// REG_ID_MTX, bit (row * NUM_OF_COLS + col) is a matrix key, the buttons follow (little endian)
+#define KEYBOARD_MATRIX_LEN		sizeof(uint64_t)
+
 struct key_callback
 {
 	void (*func)(uint8_t key, enum key_state state);
@@ -27,4 +38,10 @@ void keyboard_inject_power_key();
 
 void keyboard_add_key_callback(struct key_callback *callback);
 
+// Everything that was down on the last scan, see KEYBOARD_MATRIX_LEN
+uint64_t keyboard_get_matrix(void);
+
+// Restarts the scan when a key is pressed while it's idle
+void keyboard_gpio_irq(uint gpio, uint32_t events);
+
 void keyboard_init(void);
@@ -0,0 +1,91 @@
+#include "latency.h"
+
+#include "reg.h"
+
+#include <hardware/structs/systick.h>
+#include <pico/stdlib.h>
+#include <string.h>
+
+#define SYSTICK_MAX			0x00FFFFFF
+
+static struct
+{
+	struct latency_stats stats[LATENCY_CLASS_COUNT];
+} self;
+
+enum latency_class latency_class_of(uint8_t reg, bool write)
+{
+	if (write)
+		return LATENCY_WRITE;
+
+	switch (reg) {
+	case REG_ID_INT:
+	case REG_ID_KEY:
+	case REG_ID_TOX:
+	case REG_ID_TOY:
+	case REG_ID_GIN:
+	case REG_ID_SNP:
+		return LATENCY_READ_STATUS;
+
+	case REG_ID_FIF:
+	case REG_ID_FIB:
+		return LATENCY_READ_FIFO;
+
+	default:
+		return LATENCY_READ_OTHER;
+	}
+}
+
+uint32_t latency_now(void)
+{
+	return systick_hw->cvr;
+}
+
+uint32_t latency_cycles_since(uint32_t start)
+{
+	// it counts down
+	return (start - systick_hw->cvr) & SYSTICK_MAX;
+}
+
+void latency_record(enum latency_class class, uint32_t start)
+{
+	if (class >= LATENCY_CLASS_COUNT)
+		return;
+
+	struct latency_stats *stats = &self.stats[class];
+	const uint32_t cycles = latency_cycles_since(start);
+	const uint8_t bucket = MIN(31 - __builtin_clz(cycles | 1), LATENCY_BUCKETS - 1);
+
+	if (stats->count < UINT32_MAX)
+		stats->count++;
+
+	if (cycles > stats->max)
+		stats->max = cycles;
+
+	if (stats->buckets[bucket] < UINT16_MAX)
+		stats->buckets[bucket]++;
+}
+
+const struct latency_stats *latency_get_stats(enum latency_class class)
+{
+	if (class >= LATENCY_CLASS_COUNT)
+		return NULL;
+
+	return &self.stats[class];
+}
+
+void latency_reset_stats(enum latency_class class)
+{
+	if (class >= LATENCY_CLASS_COUNT)
+		return;
+
+	memset(&self.stats[class], 0, sizeof(self.stats[class]));
+}
+
+void latency_init(void)
+{
+	// free running 24-bit down counter at the CPU clock
+	systick_hw->rvr = SYSTICK_MAX;
+	systick_hw->cvr = 0;
+	systick_hw->csr = M0PLUS_SYST_CSR_CLKSOURCE_BITS | M0PLUS_SYST_CSR_ENABLE_BITS;
+}
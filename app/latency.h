@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Groups of registers the puppet interface keeps access latency statistics for
+enum latency_class
+{
+	LATENCY_READ_STATUS = 0,	// INT, KEY, TOX, TOY, GIN and SNP
+	LATENCY_READ_FIFO,			// FIF and FIB
+	LATENCY_READ_OTHER,
+	LATENCY_WRITE,				// until the write (or the whole block) is applied
+
+	LATENCY_CLASS_COUNT,
+};
+
+// bucket n counts latencies of 2^n to 2^(n+1)-1 cycles, the last one everything above
+#define LATENCY_BUCKETS		16
+
+struct latency_stats
+{
+	uint32_t count;
+	uint32_t max;
+	uint16_t buckets[LATENCY_BUCKETS];
+};
+
+enum latency_class latency_class_of(uint8_t reg, bool write);
+
+// SysTick based, in CPU cycles, only good for intervals shorter than 2^24 cycles
+uint32_t latency_now(void);
+uint32_t latency_cycles_since(uint32_t start);
+
+void latency_record(enum latency_class class, uint32_t start);
+
+const struct latency_stats *latency_get_stats(enum latency_class class);
+void latency_reset_stats(enum latency_class class);
+
+void latency_init(void);
@@ -6,13 +6,16 @@
 
 #include "backlight.h"
 #include "debug.h"
+#include "event.h"
 #include "gpioexp.h"
 #include "interrupt.h"
 #include "keyboard.h"
+#include "latency.h"
 #include "puppet_i2c.h"
 #include "reg.h"
 #include "touchpad.h"
 #include "usb.h"
+#include "watch.h"
 #include "pi.h"
 
 #if ENABLE_ESP32_SUPPORT
@@ -23,6 +26,7 @@
 static void gpio_irq(uint gpio, uint32_t events)
 {
 //	printf("%s: gpio %d, events 0x%02X\r\n", __func__, gpio, events);
+	keyboard_gpio_irq(gpio, events);
 	touchpad_gpio_irq(gpio, events);
 	gpioexp_gpio_irq(gpio, events);
 }
@@ -51,6 +55,12 @@ int main(void)
 
 	interrupt_init();
 
+	watch_init();
+
+	event_init();
+
+	latency_init();
+
 	puppet_i2c_init();
 
 	// For now, the `gpio` param is ignored and all enabled GPIOs generate the irq
@@ -71,6 +81,10 @@ int main(void)
 
 	while (true) {
 		__wfe();
+
+#ifndef NDEBUG
+		debug_task();
+#endif
 	}
 
 	return 0;
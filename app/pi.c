@@ -1,4 +1,5 @@
 #include "pi.h"
+#include "event.h"
 #include "reg.h"
 #include "keyboard.h"
 #include "gpioexp.h"
@@ -46,6 +47,8 @@ void pi_power_on(enum power_on_reason reason)
 
 	// Update startup reason
 	reg_set_value(REG_ID_STARTUP_REASON, reason);
+
+	event_push_system(EVENT_SYSTEM_POWER_ON, reason);
 }
 
 void pi_power_off(void)
@@ -79,6 +82,8 @@ static int64_t pi_power_off_alarm_callback(alarm_id_t _, void* __)
 
 void pi_schedule_power_off(uint32_t ms)
 {
+	event_push_system(EVENT_SYSTEM_POWER_OFF, MIN(ms / 1000, UINT8_MAX));
+
 	add_alarm_in_ms(ms, pi_power_off_alarm_callback, NULL, true);
 }
 
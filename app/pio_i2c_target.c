@@ -0,0 +1,317 @@
+#include "pio_i2c_target.h"
+
+#include "pio_i2c_target.pio.h"
+
+#include <hardware/clocks.h>
+#include <hardware/dma.h>
+#include <hardware/irq.h>
+#include <hardware/pio.h>
+#include <hardware/regs/addressmap.h>
+#include <hardware/regs/m0plus.h>
+#include <pico/stdlib.h>
+
+// the delays in the program assume this
+#define PIO_FREQ			(16 * 1000 * 1000)
+
+// see pio_i2c_target.pio
+#define DECISION_TRANSMIT	0x40
+#define DECISION_NACK		0x80
+
+#define IRQ_START			0
+#define IRQ_STOP			1
+
+// fed to the state machine during a write: ACK the address and every byte that fits, then NACK
+static const uint8_t write_decisions[PIO_I2C_TARGET_BUFFER_SIZE + 2] =
+{
+	[PIO_I2C_TARGET_BUFFER_SIZE + 1] = DECISION_NACK,
+};
+
+static struct
+{
+	// the target program doesn't leave enough room for the condition one, so it gets the other PIO
+	PIO pio;
+	uint sm;
+	uint offset;
+
+	// let go of both lines, then back to the start, for restart_target()
+	uint32_t release_instr;
+	uint32_t receive_instr;
+
+	PIO cond_pio;
+	uint cond_sm;
+
+	uint rx_dma;
+	uint tx_dma;
+
+	struct
+	{
+		uint8_t address;
+		const struct pio_i2c_target_handler *handler;
+	} targets[PIO_I2C_TARGET_MAX_ADDRESSES];
+
+	// the target the ongoing transaction is addressed to
+	const struct pio_i2c_target_handler *active;
+	bool reading;
+
+	uint8_t rx_buffer[PIO_I2C_TARGET_BUFFER_SIZE];
+
+	// the decision for the address goes first
+	uint8_t tx_buffer[PIO_I2C_TARGET_BUFFER_SIZE + 1];
+	uint8_t tx_len;
+
+	// the transaction that ended, handed from the condition irq over to the target irq
+	struct
+	{
+		const struct pio_i2c_target_handler *handler;
+		bool reading;
+		uint8_t len;
+	} ended;
+	volatile bool end_pending;
+} self;
+
+static const struct pio_i2c_target_handler *find_handler(uint8_t address)
+{
+	for (int i = 0; i < PIO_I2C_TARGET_MAX_ADDRESSES; ++i) {
+		if (self.targets[i].handler && (self.targets[i].address == address))
+			return self.targets[i].handler;
+	}
+
+	return NULL;
+}
+
+// From here to cond_irq() everything has to be done before the next address bit, so it runs from RAM
+// and only touches registers: the SDK helpers may be in flash, and some wait on the hardware.
+
+static void __not_in_flash_func(abort_dma)(void)
+{
+	uint32_t busy = 0;
+
+	// a write is also fed decisions, stop both, an abort of an idle channel would only wait
+	if (dma_hw->ch[self.tx_dma].ctrl_trig & DMA_CH0_CTRL_TRIG_BUSY_BITS)
+		busy |= 1u << self.tx_dma;
+
+	if (dma_hw->ch[self.rx_dma].ctrl_trig & DMA_CH0_CTRL_TRIG_BUSY_BITS)
+		busy |= 1u << self.rx_dma;
+
+	if (!busy)
+		return;
+
+	dma_hw->abort = busy;
+
+	while (dma_hw->abort & busy)
+		;
+}
+
+static void __not_in_flash_func(end_transaction)(void)
+{
+	abort_dma();
+
+	if (!self.active)
+		return;
+
+	uint32_t len = 0;
+
+	if (self.reading) {
+		// whatever is still in the FIFO was never pulled, the first byte is the decision
+		const uint32_t pulled = self.tx_len + 1 - dma_hw->ch[self.tx_dma].transfer_count;
+		const uint32_t level = self.pio->flevel >> (PIO_FLEVEL_TX0_LSB + self.sm * (PIO_FLEVEL_TX1_LSB - PIO_FLEVEL_TX0_LSB));
+		const uint32_t pending = (level & (PIO_FLEVEL_TX0_BITS >> PIO_FLEVEL_TX0_LSB)) + 1;
+
+		len = (pulled > pending) ? (pulled - pending) : 0;
+	} else {
+		len = PIO_I2C_TARGET_BUFFER_SIZE - dma_hw->ch[self.rx_dma].transfer_count;
+
+		while (!(self.pio->fstat & (1u << (PIO_FSTAT_RXEMPTY_LSB + self.sm)))) {
+			const uint8_t data = self.pio->rxf[self.sm];
+
+			// the byte after a full buffer was NACKed
+			if (len < PIO_I2C_TARGET_BUFFER_SIZE)
+				self.rx_buffer[len++] = data;
+		}
+
+		// back to looking at each address as it comes in
+		hw_set_bits(&self.pio->inte0, 1u << (pis_sm0_rx_fifo_not_empty + self.sm));
+	}
+
+	self.ended.handler = self.active;
+	self.ended.reading = self.reading;
+	self.ended.len = len;
+	self.end_pending = true;
+
+	self.active = NULL;
+}
+
+static void __not_in_flash_func(restart_target)(void)
+{
+	// toggling the join twice empties both FIFOs
+	hw_xor_bits(&self.pio->sm[self.sm].shiftctrl, PIO_SM0_SHIFTCTRL_FJOIN_RX_BITS);
+	hw_xor_bits(&self.pio->sm[self.sm].shiftctrl, PIO_SM0_SHIFTCTRL_FJOIN_RX_BITS);
+
+	hw_set_bits(&self.pio->ctrl, 1u << (PIO_CTRL_SM_RESTART_LSB + self.sm));
+
+	// let go of both lines, no matter where the program was
+	self.pio->sm[self.sm].instr = self.release_instr;
+	self.pio->sm[self.sm].instr = self.receive_instr;
+}
+
+// Highest priority, the state machine has to be back at the start before the first address bit.
+// Only touches the PIO and DMA, the handlers are called from target_irq().
+static void __not_in_flash_func(cond_irq)(void)
+{
+	self.cond_pio->irq = (1u << IRQ_START) | (1u << IRQ_STOP);
+
+	end_transaction();
+	restart_target();
+
+	// irq_set_pending()
+	if (self.end_pending)
+		*(io_rw_32 *)(PPB_BASE + M0PLUS_NVIC_ISPR_OFFSET) = 1u << PIO0_IRQ_0;
+}
+
+static void begin_transaction(uint8_t address, bool read)
+{
+	const struct pio_i2c_target_handler *handler = find_handler(address);
+
+	// not for us, SCL is released right away
+	if (!handler) {
+		pio_sm_put(self.pio, self.sm, (uint32_t)DECISION_NACK << 24);
+		return;
+	}
+
+	self.active = handler;
+	self.reading = read;
+
+	// SCL is stretched until the DMA delivers the decision, so everything has to be in place by then
+	if (read) {
+		self.tx_buffer[0] = DECISION_TRANSMIT;
+		self.tx_len = handler->request(&self.tx_buffer[1], PIO_I2C_TARGET_BUFFER_SIZE);
+
+		dma_channel_transfer_from_buffer_now(self.tx_dma, self.tx_buffer, self.tx_len + 1);
+	} else {
+		// the data isn't looked at until the write ends
+		pio_set_irq0_source_enabled(self.pio, pis_sm0_rx_fifo_not_empty + self.sm, false);
+
+		dma_channel_transfer_to_buffer_now(self.rx_dma, self.rx_buffer, PIO_I2C_TARGET_BUFFER_SIZE);
+		dma_channel_transfer_from_buffer_now(self.tx_dma, write_decisions, sizeof(write_decisions));
+	}
+}
+
+static void target_irq(void)
+{
+	// hand over the previous transaction first, it may be the register select for this one
+	if (self.end_pending) {
+		self.end_pending = false;
+
+		if (self.ended.reading) {
+			if (self.ended.handler->sent)
+				self.ended.handler->sent(self.ended.len);
+		} else {
+			if (self.ended.handler->receive)
+				self.ended.handler->receive(self.rx_buffer, self.ended.len);
+		}
+	}
+
+	// an address came in, SCL is held low until we decide
+	if (!pio_sm_is_rx_fifo_empty(self.pio, self.sm)) {
+		const uint8_t data = pio_sm_get(self.pio, self.sm);
+
+		begin_transaction(data >> 1, data & 0x01);
+	}
+}
+
+int pio_i2c_target_add(uint8_t address, const struct pio_i2c_target_handler *handler)
+{
+	for (int i = 0; i < PIO_I2C_TARGET_MAX_ADDRESSES; ++i) {
+		if (self.targets[i].handler)
+			continue;
+
+		self.targets[i].address = address;
+		self.targets[i].handler = handler;
+
+		return i;
+	}
+
+	return -1;
+}
+
+void pio_i2c_target_set_address(int slot, uint8_t address)
+{
+	if ((slot < 0) || (slot >= PIO_I2C_TARGET_MAX_ADDRESSES))
+		return;
+
+	self.targets[slot].address = address;
+}
+
+void pio_i2c_target_init(uint sda, uint scl)
+{
+	const uint32_t pins = (1u << sda) | (1u << scl);
+
+	self.pio = pio0;
+	self.sm = pio_claim_unused_sm(self.pio, true);
+	self.offset = pio_add_program(self.pio, &i2c_target_program);
+
+	self.release_instr = pio_encode_set(pio_pindirs, 0) | pio_encode_sideset_opt(1, 0);
+	self.receive_instr = pio_encode_jmp(self.offset + i2c_target_offset_receive);
+
+	self.cond_pio = pio1;
+	self.cond_sm = pio_claim_unused_sm(self.cond_pio, true);
+	const uint cond_offset = pio_add_program(self.cond_pio, &i2c_target_cond_program);
+
+	// open drain, the outputs stay low and only the directions are switched
+	pio_sm_set_pins_with_mask(self.pio, self.sm, 0, pins);
+	pio_sm_set_pindirs_with_mask(self.pio, self.sm, 0, pins);
+
+	pio_gpio_init(self.pio, sda);
+	gpio_pull_up(sda);
+
+	pio_gpio_init(self.pio, scl);
+	gpio_pull_up(scl);
+
+	pio_sm_config config = i2c_target_program_get_default_config(self.offset);
+	sm_config_set_in_pins(&config, sda);
+	sm_config_set_out_pins(&config, sda, 1);
+	sm_config_set_set_pins(&config, sda, 1);
+	sm_config_set_sideset_pins(&config, scl);
+	sm_config_set_jmp_pin(&config, sda);
+
+	// MSB first both ways, the decision/data byte is in the top bits (narrow writes are replicated)
+	sm_config_set_in_shift(&config, false, false, 8);
+	sm_config_set_out_shift(&config, false, false, 8);
+	sm_config_set_clkdiv(&config, (float)clock_get_hz(clk_sys) / PIO_FREQ);
+	pio_sm_init(self.pio, self.sm, self.offset + i2c_target_offset_receive, &config);
+
+	// full speed, the conditions are only a few cycles apart from the SCL edges
+	pio_sm_config cond_config = i2c_target_cond_program_get_default_config(cond_offset);
+	sm_config_set_in_pins(&cond_config, sda);
+	sm_config_set_jmp_pin(&cond_config, scl);
+	pio_sm_init(self.cond_pio, self.cond_sm, cond_offset, &cond_config);
+
+	self.rx_dma = dma_claim_unused_channel(true);
+	dma_channel_config rx_config = dma_channel_get_default_config(self.rx_dma);
+	channel_config_set_transfer_data_size(&rx_config, DMA_SIZE_8);
+	channel_config_set_read_increment(&rx_config, false);
+	channel_config_set_write_increment(&rx_config, true);
+	channel_config_set_dreq(&rx_config, pio_get_dreq(self.pio, self.sm, false));
+	dma_channel_configure(self.rx_dma, &rx_config, self.rx_buffer, &self.pio->rxf[self.sm], 0, false);
+
+	self.tx_dma = dma_claim_unused_channel(true);
+	dma_channel_config tx_config = dma_channel_get_default_config(self.tx_dma);
+	channel_config_set_transfer_data_size(&tx_config, DMA_SIZE_8);
+	channel_config_set_read_increment(&tx_config, true);
+	channel_config_set_write_increment(&tx_config, false);
+	channel_config_set_dreq(&tx_config, pio_get_dreq(self.pio, self.sm, true));
+	dma_channel_configure(self.tx_dma, &tx_config, &self.pio->txf[self.sm], self.tx_buffer, 0, false);
+
+	pio_set_irq0_source_enabled(self.cond_pio, pis_interrupt0 + IRQ_START, true);
+	pio_set_irq0_source_enabled(self.cond_pio, pis_interrupt0 + IRQ_STOP, true);
+	irq_set_exclusive_handler(PIO1_IRQ_0, cond_irq);
+	irq_set_priority(PIO1_IRQ_0, PICO_HIGHEST_IRQ_PRIORITY);
+	irq_set_enabled(PIO1_IRQ_0, true);
+
+	pio_set_irq0_source_enabled(self.pio, pis_sm0_rx_fifo_not_empty + self.sm, true);
+	irq_set_exclusive_handler(PIO0_IRQ_0, target_irq);
+	irq_set_enabled(PIO0_IRQ_0, true);
+
+	pio_sm_set_enabled(self.pio, self.sm, true);
+	pio_sm_set_enabled(self.cond_pio, self.cond_sm, true);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Most a single write can carry, and a single read can return before it's padded with 0x00 (lengths are 8 bit)
+#define PIO_I2C_TARGET_BUFFER_SIZE		255
+
+#define PIO_I2C_TARGET_MAX_ADDRESSES	4
+
+struct pio_i2c_target_handler
+{
+	// a write ended, with everything the controller sent after the address
+	void (*receive)(const uint8_t *data, uint8_t len);
+
+	// the controller wants to read, fill in the response and return its length
+	uint8_t (*request)(uint8_t *data, uint8_t size);
+
+	// the read ended after this many bytes of the response were clocked out
+	void (*sent)(uint8_t len);
+};
+
+// returns the slot of the address, -1 if all are taken
+int pio_i2c_target_add(uint8_t address, const struct pio_i2c_target_handler *handler);
+void pio_i2c_target_set_address(int slot, uint8_t address);
+
+// SCL has to be SDA + 1
+void pio_i2c_target_init(uint sda, uint scl);
@@ -1,73 +1,534 @@
 #include "puppet_i2c.h"
 
+#include "gpioexp_i2c.h"
+#include "hid_i2c.h"
+#include "i2c_speed.h"
+#include "latency.h"
+#include "pio_i2c_target.h"
 #include "reg.h"
+#include "rtc_i2c.h"
 
 #include <hardware/i2c.h>
 #include <hardware/irq.h>
 #include <pico/stdlib.h>
+#include <string.h>
+
+#if defined(PUPPET_I2C_HID) && !defined(PUPPET_I2C_PIO)
+#error "The HID over I2C personality needs PUPPET_I2C_PIO"
+#endif
+
+#if defined(PUPPET_I2C_RTC) && !defined(PUPPET_I2C_PIO)
+#error "The RTC on a second address needs PUPPET_I2C_PIO"
+#endif
+
+#if defined(PUPPET_I2C_GPIO) && !defined(PUPPET_I2C_PIO)
+#error "The GPIO expander on a second address needs PUPPET_I2C_PIO"
+#endif
 
 #define REG_ID_INVALID		0x00
 
+// RX_FULL fires once more than this many bytes are waiting, the rest is drained on STOP/RESTART/RD_REQ
+#define RX_THRESHOLD		3
+
+// where the SMBus host listens for notifications
+#define HOST_NOTIFY_ADDRESS		0x08
+
+// 3 bytes take ~350us at 100kHz, give up on the bus if it's held for longer than that
+#define HOST_NOTIFY_TIMEOUT_US	1000
+
+// irq when the controller sends data, when it requests a read, and when the transaction ends
+#define TARGET_INTR_MASK	(I2C_IC_INTR_MASK_M_RD_REQ_BITS | I2C_IC_INTR_MASK_M_RX_FULL_BITS | \
+							 I2C_IC_INTR_MASK_M_TX_ABRT_BITS | I2C_IC_INTR_MASK_M_STOP_DET_BITS | \
+							 I2C_IC_INTR_MASK_M_RESTART_DET_BITS)
+
+// while sending a Host Notify, only how it ended matters
+#define NOTIFY_INTR_MASK	(I2C_IC_INTR_MASK_M_TX_ABRT_BITS | I2C_IC_INTR_MASK_M_STOP_DET_BITS)
+
+#ifndef PUPPET_I2C_PIO
 static i2c_inst_t *i2c_instances[2] = { i2c0, i2c1 };
+#endif
 
 static struct
 {
 	i2c_inst_t *i2c;
 
+	struct reg_context reg;
+
+	// register selected by the first byte of the current write, if it's a reg write
+	uint8_t rx_reg;
+
+	uint8_t write_buffer[REG_BUFFER_SIZE];
+	uint8_t write_len;
+	uint8_t write_idx;
+
+	// bytes of write_buffer pushed to the TX FIFO
+	uint16_t write_sent;
+
+	// register the current burst read started at, and the one being sent
+	uint8_t burst_start;
+	uint8_t burst_reg;
+
+	uint32_t isr_max_cycles;
+
+	// a new bus speed was written while a transaction was going on
+	bool speed_pending;
+
+	// a Host Notify is on the bus, the I2C block is the controller until it's done
+	void (*notify_done)(bool sent);
+	alarm_id_t notify_timeout;
+
+#ifdef PUPPET_I2C_PIO
+	int pio_slot;
+
+	// registers a PIO response was made of, so the read can be committed per register
 	struct
 	{
 		uint8_t reg;
-		uint8_t data;
-	} read_buffer;
-
-	uint8_t write_buffer[2];
-	uint8_t write_len;
+		uint8_t len;
+	} segments[PIO_I2C_TARGET_BUFFER_SIZE];
+	uint8_t segment_count;
+#endif
 } self;
 
-static void irq_handler(void)
+static void record_cycles(uint32_t start)
 {
-	// the controller sent data
-	if (self.i2c->hw->intr_stat & I2C_IC_INTR_MASK_M_RX_FULL_BITS) {
-		if (self.read_buffer.reg == REG_ID_INVALID) {
-			self.read_buffer.reg = self.i2c->hw->data_cmd & 0xff;
+	const uint32_t cycles = latency_cycles_since(start);
+	if (cycles > self.isr_max_cycles)
+		self.isr_max_cycles = cycles;
+}
 
-			if (self.read_buffer.reg & PACKET_WRITE_MASK) {
-				// it'sq a reg write, we need to wait for the second byte before we process
-				return;
-			}
+static void select_register(uint8_t reg)
+{
+	self.burst_start = reg;
+	self.burst_reg = reg;
+}
+
+static void select_read(uint8_t reg)
+{
+	reg_process_packet(&self.reg, reg, 0, self.write_buffer, &self.write_len);
+
+	self.write_idx = 0;
+	self.write_sent = 0;
+	select_register(reg);
+}
+
+static void receive_byte(uint8_t data)
+{
+	if (self.rx_reg == REG_ID_INVALID) {
+		if (data & PACKET_WRITE_MASK) {
+			// it's a reg write, the data follows
+			self.rx_reg = data;
+			reg_begin_block(&self.reg);
 		} else {
-			self.read_buffer.data = self.i2c->hw->data_cmd & 0xff;
+#ifdef PUPPET_I2C_PIO
+			// the response is only made when the read is addressed, see pio_request()
+			select_register(data);
+#else
+			select_read(data);
+#endif
+		}
+		return;
+	}
+
+	reg_process_packet(&self.reg, self.rx_reg, data, self.write_buffer, &self.write_len);
+
+	self.write_idx = 0;
+	self.write_sent = 0;
+
+	// a block write continues with the following register
+	self.rx_reg = reg_block_next(self.rx_reg);
+}
+
+static void end_write(void)
+{
+	// apply everything the controller wrote in one go
+	if (self.rx_reg & PACKET_WRITE_MASK)
+		reg_end_block(&self.reg);
+
+	self.rx_reg = REG_ID_INVALID;
+}
+
+#ifdef PUPPET_I2C_PIO
+
+static void apply_speed(void)
+{
+	// the PIO follows whatever SCL does, only the pads need to keep up
+	i2c_speed_apply_pads(PIN_PUPPET_SDA, PIN_PUPPET_SCL, BUS_PUPPET_SPEED(reg_get_value(REG_ID_BUS)));
+}
+
+static void pio_receive(const uint8_t *data, uint8_t len)
+{
+	const uint32_t start = latency_now();
+	const bool write = (len > 1) && (data[0] & PACKET_WRITE_MASK);
+
+	for (uint8_t i = 0; i < len; ++i)
+		receive_byte(data[i]);
+
+	end_write();
+
+	if (write)
+		latency_record(LATENCY_WRITE, start);
+
+	record_cycles(start);
+}
+
+// The whole response is prepared when the read is addressed: the selected register followed by the
+// rest of the REG_AIW window, or the register repeated without one. Unlike the I2C block the window
+// doesn't wrap around, the registers would be read again before the first read of them is committed.
+static uint8_t pio_request(uint8_t *data, uint8_t size)
+{
+	const uint32_t start = latency_now();
+	const uint8_t window = reg_get_value(REG_ID_AIW);
+	uint8_t len = 0;
+
+	select_read(self.burst_start);
+	self.segment_count = 0;
+
+	while ((len < size) && (self.write_len > 0)) {
+		const uint8_t count = MIN(self.write_len, size - len);
+
+		memcpy(&data[len], self.write_buffer, count);
+		len += count;
+
+		// auto-increment disabled, the repeats only count as a single read
+		if (window == 0) {
+			if (self.segment_count == 0) {
+				self.segments[0].reg = self.burst_reg;
+				self.segments[0].len = self.write_len;
+				self.segment_count = 1;
+			}
+			continue;
 		}
 
-		reg_process_packet(self.read_buffer.reg, self.read_buffer.data, self.write_buffer, &self.write_len);
+		self.segments[self.segment_count].reg = self.burst_reg;
+		self.segments[self.segment_count].len = count;
+		self.segment_count++;
+
+		self.burst_reg++;
+
+		if (((uint8_t)(self.burst_reg - self.burst_start) >= window) || (self.burst_reg >= REG_ID_LAST))
+			break;
+
+		reg_process_burst(&self.reg, self.burst_reg, self.write_buffer, &self.write_len);
+	}
+
+	latency_record(latency_class_of(self.burst_start, false), start);
+	record_cycles(start);
+
+	return len;
+}
+
+static void pio_sent(uint8_t len)
+{
+	const uint32_t start = latency_now();
+
+	for (uint8_t i = 0; (i < self.segment_count) && (len > 0); ++i) {
+		const uint8_t count = MIN(len, self.segments[i].len);
+
+		reg_commit_read(&self.reg, self.segments[i].reg, count);
+		len -= count;
+	}
+
+	self.segment_count = 0;
+
+	record_cycles(start);
+}
+
+static const struct pio_i2c_target_handler pio_handler =
+{
+	.receive = pio_receive,
+	.request = pio_request,
+	.sent = pio_sent,
+};
 
-		// ready for the next operation
-		self.read_buffer.reg = REG_ID_INVALID;
+#else
 
+static void apply_speed(void)
+{
+	i2c_speed_apply(self.i2c, PIN_PUPPET_SDA, PIN_PUPPET_SCL, BUS_PUPPET_SPEED(reg_get_value(REG_ID_BUS)));
+
+	self.speed_pending = false;
+}
+
+static void commit_read(void)
+{
+	if (self.write_sent == 0)
 		return;
+
+	// the controller NACKed early, whatever is left in the FIFO never made it out
+	// (the hardware flushes it on the next read request)
+	const uint16_t pending = self.i2c->hw->txflr;
+	const uint16_t sent = self.write_sent - MIN(pending, self.write_sent);
+
+	reg_commit_read(&self.reg, self.burst_reg, MIN(sent, self.write_len));
+
+	self.write_sent = 0;
+}
+
+static void next_burst_register(void)
+{
+	const uint8_t window = reg_get_value(REG_ID_AIW);
+
+	self.write_idx = 0;
+
+	// auto-increment disabled, keep repeating the same register
+	if (window == 0)
+		return;
+
+	commit_read();
+
+	self.burst_reg++;
+
+	if (((uint8_t)(self.burst_reg - self.burst_start) >= window) || (self.burst_reg >= REG_ID_LAST))
+		self.burst_reg = self.burst_start;
+
+	reg_process_burst(&self.reg, self.burst_reg, self.write_buffer, &self.write_len);
+}
+
+static void end_transaction(uint32_t start)
+{
+	const bool write = self.rx_reg & PACKET_WRITE_MASK;
+
+	commit_read();
+	end_write();
+
+	if (write)
+		latency_record(LATENCY_WRITE, start);
+}
+
+static void drain_rx(uint32_t start)
+{
+	while (self.i2c->hw->rxflr) {
+		const uint32_t data_cmd = self.i2c->hw->data_cmd;
+		const uint8_t data = data_cmd & I2C_IC_DATA_CMD_DAT_BITS;
+
+		// the first byte after the address always selects the register, no matter what came before
+		if (data_cmd & I2C_IC_DATA_CMD_FIRST_DATA_BYTE_BITS)
+			end_transaction(start);
+
+		const bool read_select = (self.rx_reg == REG_ID_INVALID) && !(data & PACKET_WRITE_MASK);
+
+		receive_byte(data);
+
+		// the response is ready for the RD_REQ that follows
+		if (read_select)
+			latency_record(latency_class_of(data, false), start);
+	}
+}
+
+static void fill_tx(void)
+{
+	// the previous register was fully clocked out, the controller wants more
+	if (self.write_idx >= self.write_len)
+		next_burst_register();
+
+	// nothing to send, still answer so the controller isn't stretched forever
+	if (self.write_len == 0) {
+		self.i2c->hw->data_cmd = 0x00;
+		return;
+	}
+
+	// only ever push what fits, the rest goes out on the next RD_REQ
+	while ((self.write_idx < self.write_len) && i2c_get_write_available(self.i2c)) {
+		self.i2c->hw->data_cmd = self.write_buffer[self.write_idx++];
+		self.write_sent++;
+	}
+}
+
+// back to being the target, interrupts have to be off
+static void end_notify(bool sent)
+{
+	void (*done)(bool) = self.notify_done;
+
+	if (self.notify_timeout)
+		cancel_alarm(self.notify_timeout);
+
+	self.notify_timeout = 0;
+	self.notify_done = NULL;
+
+	i2c_set_slave_mode(self.i2c, true, reg_get_value(REG_ID_ADR));
+	self.i2c->hw->intr_mask = TARGET_INTR_MASK;
+	self.i2c->hw->clr_intr;
+
+	if (self.speed_pending)
+		apply_speed();
+
+	if (done)
+		done(sent);
+}
+
+// a lost arbitration or a NACK aborts the transfer, the hardware backs off the bus by itself
+static void notify_irq(uint32_t stat)
+{
+	if (stat & I2C_IC_INTR_STAT_R_TX_ABRT_BITS)
+		end_notify(false);
+	else if (stat & I2C_IC_INTR_STAT_R_STOP_DET_BITS)
+		end_notify(true);
+}
+
+static int64_t notify_timeout_callback(alarm_id_t id, void *user_data)
+{
+	(void)id;
+	(void)user_data;
+
+	const int irq = I2C0_IRQ + i2c_hw_index(self.i2c);
+
+	irq_set_enabled(irq, false);
+
+	// the bus is held by someone else, let go of it
+	self.notify_timeout = 0;
+
+	if (self.notify_done)
+		end_notify(false);
+
+	irq_set_enabled(irq, true);
+
+	return 0;
+}
+
+static void irq_handler(void)
+{
+	const uint32_t start = latency_now();
+	const uint32_t stat = self.i2c->hw->intr_stat;
+
+	if (self.notify_done) {
+		notify_irq(stat);
+		return;
+	}
+
+	// stale data was flushed from the TX FIFO, already accounted for in commit_read()
+	if (stat & I2C_IC_INTR_STAT_R_TX_ABRT_BITS)
+		self.i2c->hw->clr_tx_abrt;
+
+	// always drain first, bytes under the threshold are only picked up here
+	drain_rx(start);
+
+	// end of the transaction, let the register know how much of it was read/written
+	if (stat & (I2C_IC_INTR_STAT_R_STOP_DET_BITS | I2C_IC_INTR_STAT_R_RESTART_DET_BITS)) {
+		end_transaction(start);
+
+		self.i2c->hw->clr_stop_det;
+		self.i2c->hw->clr_restart_det;
+
+		if (self.speed_pending && (stat & I2C_IC_INTR_STAT_R_STOP_DET_BITS))
+			apply_speed();
 	}
 
 	// the controller requested a read
-	if (self.i2c->hw->intr_stat & I2C_IC_INTR_MASK_M_RD_REQ_BITS) {
-		i2c_write_raw_blocking(self.i2c, self.write_buffer, self.write_len);
+	if (stat & I2C_IC_INTR_STAT_R_RD_REQ_BITS) {
+		fill_tx();
 
 		self.i2c->hw->clr_rd_req;
-		return;
 	}
+
+	record_cycles(start);
 }
 
+#endif
+
+uint32_t puppet_i2c_get_isr_max_cycles(void)
+{
+	return self.isr_max_cycles;
+}
+
+void puppet_i2c_reset_isr_max_cycles(void)
+{
+	self.isr_max_cycles = 0;
+}
+
+#ifdef PUPPET_I2C_PIO
+
 void puppet_i2c_sync_address(void)
 {
+	pio_i2c_target_set_address(self.pio_slot, reg_get_value(REG_ID_ADR));
+}
+
+void puppet_i2c_sync_speed(void)
+{
+	apply_speed();
+}
+
+bool puppet_i2c_host_notify(uint16_t data, void (*done)(bool sent))
+{
+	// the PIO target can't act as a controller
+	(void)data;
+	(void)done;
+
+	return false;
+}
+
+#else
+
+void puppet_i2c_sync_address(void)
+{
+	// end_notify() picks it up
+	if (self.notify_done)
+		return;
+
 	i2c_set_slave_mode(self.i2c, true, reg_get_value(REG_ID_ADR));
 }
 
-void puppet_i2c_init(void)
+void puppet_i2c_sync_speed(void)
+{
+	// reconfiguring disables the controller, don't pull the rug out from under a transaction
+	if (self.notify_done || (self.i2c->hw->status & I2C_IC_STATUS_SLV_ACTIVITY_BITS)) {
+		self.speed_pending = true;
+		return;
+	}
+
+	apply_speed();
+}
+
+bool puppet_i2c_host_notify(uint16_t data, void (*done)(bool sent))
+{
+	const int irq = I2C0_IRQ + i2c_hw_index(self.i2c);
+
+	irq_set_enabled(irq, false);
+
+	// don't cut into a transaction, ours or anyone else's
+	if (self.notify_done || (self.i2c->hw->status & I2C_IC_STATUS_ACTIVITY_BITS) ||
+		!gpio_get(PIN_PUPPET_SDA) || !gpio_get(PIN_PUPPET_SCL)) {
+		irq_set_enabled(irq, true);
+		return false;
+	}
+
+	// briefly become the controller, the target side doesn't answer in the meantime
+	i2c_set_slave_mode(self.i2c, false, 0);
+	self.i2c->hw->enable = 0;
+	self.i2c->hw->tar = HOST_NOTIFY_ADDRESS;
+	self.i2c->hw->intr_mask = NOTIFY_INTR_MASK;
+	self.i2c->hw->enable = 1;
+	self.i2c->hw->clr_intr;
+
+	self.notify_done = done;
+
+	// our address, then the data word LSB first, irq_handler() reports how it went
+	const uint8_t msg[] = { reg_get_value(REG_ID_ADR) << 1, data & 0xFF, data >> 8 };
+
+	for (size_t i = 0; i < sizeof(msg); ++i)
+		self.i2c->hw->data_cmd = msg[i] | ((i == sizeof(msg) - 1) ? I2C_IC_DATA_CMD_STOP_BITS : 0);
+
+	self.notify_timeout = add_alarm_in_us(HOST_NOTIFY_TIMEOUT_US, notify_timeout_callback, NULL, true);
+
+	irq_set_enabled(irq, true);
+
+	return true;
+}
+
+static void init_i2c(void)
 {
 	// determine the instance based on SCL pin, hope you didn't screw up the SDA pin!
 	self.i2c = i2c_instances[(PIN_PUPPET_SCL / 2) % 2];
 
-	i2c_init(self.i2c, 100 * 1000);
+	i2c_init(self.i2c, i2c_speed_to_baudrate(BUS_PUPPET_SPEED(reg_get_value(REG_ID_BUS))));
 	puppet_i2c_sync_address();
+	apply_speed();
+
+	// don't wake up for STOPs of transactions meant for other devices on the bus
+	self.i2c->hw->enable = 0;
+	hw_set_bits(&self.i2c->hw->con, I2C_IC_CON_STOP_DET_IFADDRESSED_BITS);
+	self.i2c->hw->rx_tl = RX_THRESHOLD;
+	self.i2c->hw->enable = 1;
 
 	gpio_set_function(PIN_PUPPET_SDA, GPIO_FUNC_I2C);
 	gpio_pull_up(PIN_PUPPET_SDA);
@@ -75,10 +536,33 @@ void puppet_i2c_init(void)
 	gpio_set_function(PIN_PUPPET_SCL, GPIO_FUNC_I2C);
 	gpio_pull_up(PIN_PUPPET_SCL);
 
-	// irq when the controller sends data, and when it requests a read
-	self.i2c->hw->intr_mask = I2C_IC_INTR_MASK_M_RD_REQ_BITS | I2C_IC_INTR_MASK_M_RX_FULL_BITS;
+	self.i2c->hw->intr_mask = TARGET_INTR_MASK;
 
 	const int irq = I2C0_IRQ + i2c_hw_index(self.i2c);
 	irq_set_exclusive_handler(irq, irq_handler);
 	irq_set_enabled(irq, true);
 }
+
+#endif
+
+void puppet_i2c_init(void)
+{
+#ifdef PUPPET_I2C_PIO
+	pio_i2c_target_init(PIN_PUPPET_SDA, PIN_PUPPET_SCL);
+#ifdef PUPPET_I2C_HID
+	hid_i2c_init();
+	self.pio_slot = pio_i2c_target_add(reg_get_value(REG_ID_ADR), hid_i2c_get_handler());
+#else
+	self.pio_slot = pio_i2c_target_add(reg_get_value(REG_ID_ADR), &pio_handler);
+#endif
+#ifdef PUPPET_I2C_RTC
+	pio_i2c_target_add(RTC_I2C_ADDRESS, rtc_i2c_get_handler());
+#endif
+#ifdef PUPPET_I2C_GPIO
+	pio_i2c_target_add(GPIOEXP_I2C_ADDRESS, gpioexp_i2c_get_handler());
+#endif
+	apply_speed();
+#else
+	init_i2c();
+#endif
+}
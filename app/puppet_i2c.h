@@ -1,5 +1,16 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 void puppet_i2c_sync_address(void);
+void puppet_i2c_sync_speed(void);
+
+uint32_t puppet_i2c_get_isr_max_cycles(void);
+void puppet_i2c_reset_isr_max_cycles(void);
+
+// Starts one attempt at an SMBus Host Notify, false if the bus is busy. Otherwise done() is called
+// from the I2C irq (or a timeout) once it's over, sent is false if arbitration was lost or the host didn't ACK.
+bool puppet_i2c_host_notify(uint16_t data, void (*done)(bool sent));
 
 void puppet_i2c_init(void);
@@ -2,8 +2,12 @@
 
 #include "app_config.h"
 #include "backlight.h"
+#include "event.h"
 #include "fifo.h"
 #include "gpioexp.h"
+#include "interrupt.h"
+#include "key_ring.h"
+#include "latency.h"
 #include "puppet_i2c.h"
 #include "keyboard.h"
 #include "touchpad.h"
@@ -11,328 +15,940 @@
 #include "hardware/adc.h"
 #include "rtc.h"
 #include "update.h"
+#include "watch.h"
 
 #if ENABLE_ESP32_SUPPORT
 #include "esp32/esp32_comm.h"
 #include "esp32/esp32_flash.h"
 #endif
 
+#include <hardware/sync.h>
 #include <pico/stdlib.h>
 #include <RP2040.h> // TODO: When there's more than one RP chip, change this to be more generic
 #include <stdio.h>
+#include <string.h>
 
 // We don't enable this by default cause it spams quite a lot
 //#define DEBUG_REGS
 
+
+// A REG_ID_LAT read: count, max and the buckets
+#define LAT_LEN				(sizeof(uint32_t) * 2 + sizeof(uint16_t) * LATENCY_BUCKETS)
+
+// A REG_ID_FST read: count, peak, enqueued, dropped and what the overflow policy did
+#define FST_LEN				(sizeof(uint16_t) * 2 + sizeof(uint32_t) * 7)
+
+// A REG_ID_KRS read: read and lost of every key ring reader
+#define KRS_LEN				(sizeof(uint32_t) * 2 * KEY_RING_READERS)
+
+// Subsystems that need to pick up new register values, run once a write (or a whole block) is done
+enum sync_hook
+{
+	SYNC_BACKLIGHT	= (1 << 0),
+	SYNC_LED		= (1 << 1),
+	SYNC_GPIO		= (1 << 2),
+	SYNC_GPIO_VALUE	= (1 << 3),
+	SYNC_ADDRESS	= (1 << 4),
+	SYNC_BUS		= (1 << 5),
+	SYNC_INT		= (1 << 6),
+	SYNC_FIFO		= (1 << 7),
+	SYNC_WATCH		= (1 << 8),
+};
+
+enum reg_flag
+{
+	REG_R			= (1 << 0),
+	REG_W			= (1 << 1),
+	REG_READ_CLEAR	= (1 << 2), // reset to 0 once read
+	REG_ATOMIC		= (1 << 3), // hooks touch state other irqs update, run them with interrupts off
+	REG_STREAM		= (1 << 4), // a block write keeps feeding the same register
+	REG_NO_BURST	= (1 << 5), // reading has side effects a burst must never trigger by accident
+	REG_NO_BLOCK	= (1 << 6), // a command, a block write running into it ends there instead
+
+	REG_RW			= REG_R | REG_W,
+};
+
+typedef void (*reg_read_fn)(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len);
+typedef void (*reg_write_fn)(struct reg_context *ctx, uint8_t reg, uint8_t value);
+typedef void (*reg_commit_fn)(struct reg_context *ctx, uint8_t reg, uint8_t len);
+
+// Registers without a read hook return their stored value, without a write hook store what's written
+struct reg_desc
+{
+	uint8_t flags;			// enum reg_flag
+	uint8_t width;			// bytes a read returns (the least of them for variable length ones)
+	uint16_t sync;			// enum sync_hook, run after a write
+	reg_read_fn read;
+	reg_write_fn write;
+	reg_commit_fn commit;	// called with how much of a read actually made it to the host
+};
+
 static struct
 {
 	uint8_t regs[REG_ID_LAST];
 } self;
 
+static int8_t sub_clamped(uint8_t value, uint8_t sub)
+{
+	const int16_t result = (int8_t)value - (int8_t)sub;
+
+	return MAX(INT8_MIN, MIN(result, INT8_MAX));
+}
+
+// little endian, returns where the next value goes
+static uint8_t *put_le(uint8_t *out, uint32_t value, uint8_t size)
+{
+	for (uint8_t i = 0; i < size; ++i)
+		*out++ = (uint8_t)((value >> (i * 8)) & 0xFF);
+
+	return out;
+}
+
+static uint8_t fifo_item_len(void)
+{
+	return reg_is_bit_set(REG_ID_CF2, CF2_FIFO_V2) ? FIFO_ITEM_V2_LEN : FIFO_ITEM_LEN;
+}
+
+// returns where the next item goes
+static uint8_t *put_fifo_item(uint8_t *out, const struct fifo_item *item, uint32_t delta_us)
+{
+	*out++ = ((uint8_t*)item)[0];
+	*out++ = ((uint8_t*)item)[1];
+
+	if (!reg_is_bit_set(REG_ID_CF2, CF2_FIFO_V2))
+		return out;
+
+	*out++ = item->mods;
+	*out++ = item->source;
+
+	return put_le(out, delta_us, sizeof(delta_us));
+}
+
+// the bytes of a block write to a 16 bit register, low byte first
+static uint16_t stream_u16(const struct reg_context *ctx, uint16_t current, uint8_t value)
+{
+	if (ctx->stream_idx == 0)
+		return value;
+
+	if (ctx->stream_idx == 1)
+		return (current & 0xFF) | (value << 8);
+
+	return current;
+}
+
+// IN2_FIFO_WM can fire again once the host drained the FIFO below the watermark
+static void sync_fifo_watermark(void)
+{
+	if (!reg_is_bit_set(REG_ID_IN2, IN2_FIFO_WM))
+		return;
+
+	if (fifo_get_watermark() && (fifo_count() >= fifo_get_watermark()))
+		return;
+
+	reg_clear_bit(REG_ID_IN2, IN2_FIFO_WM);
+
+	if (reg_get_value(REG_ID_IN2) == 0)
+		reg_clear_bit(REG_ID_INT, INT_IN2);
+
+	interrupt_sync();
+}
+
 static void touch_cb(int8_t x, int8_t y)
 {
 	const int16_t dx = (int8_t)self.regs[REG_ID_TOX] + x;
 	const int16_t dy = (int8_t)self.regs[REG_ID_TOY] + y;
 
 	// bind to -128 to 127
-	self.regs[REG_ID_TOX] = MAX(INT8_MIN, MIN(dx, INT8_MAX));
-	self.regs[REG_ID_TOY] = MAX(INT8_MIN, MIN(dy, INT8_MAX));
+	reg_set_value(REG_ID_TOX, MAX(INT8_MIN, MIN(dx, INT8_MAX)));
+	reg_set_value(REG_ID_TOY, MAX(INT8_MIN, MIN(dy, INT8_MAX)));
 }
 static struct touch_callback touch_callback = { .func = touch_cb };
 
+static void run_pending_sync(struct reg_context *ctx)
+{
+	const uint16_t pending = ctx->pending_sync;
+
+	ctx->pending_sync = 0;
+
+	if (pending & SYNC_BACKLIGHT)
+		backlight_sync();
+
+	if (pending & SYNC_LED)
+		led_sync();
+
+	// direction before value, so a block can switch a pin to output and set it in one go
+	if (pending & SYNC_GPIO)
+		gpioexp_update(ctx->pending_dir, ctx->pending_pue, ctx->pending_pud);
+
+	if (pending & SYNC_GPIO_VALUE)
+		gpioexp_set_value(ctx->pending_gio);
+
+	if (pending & SYNC_ADDRESS)
+		puppet_i2c_sync_address();
+
+	if (pending & SYNC_BUS) {
+		puppet_i2c_sync_speed();
+		touchpad_sync_speed();
+	}
+
+	if (pending & SYNC_INT)
+		interrupt_sync();
+
+	if (pending & SYNC_FIFO) {
+		const uint32_t irq_status = save_and_disable_interrupts();
+
+		fifo_set_capacity(ctx->pending_fifo_depth);
+		fifo_set_watermark(ctx->pending_fifo_watermark);
+		sync_fifo_watermark();
+
+		restore_interrupts(irq_status);
+	}
+
+	if (pending & SYNC_WATCH) {
+		const uint32_t irq_status = save_and_disable_interrupts();
+
+		watch_set_mask(ctx->pending_watch);
+
+		restore_interrupts(irq_status);
+	}
+}
+
 static int64_t update_commit_alarm_callback(alarm_id_t _, void* __)
 {
 	update_commit_and_reboot();
 }
 
-void reg_process_packet(uint8_t in_reg, uint8_t in_data, uint8_t *out_buffer, uint8_t *out_len)
+static void read_version(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
 {
-	int rc;
-	const bool is_write = (in_reg & PACKET_WRITE_MASK);
-	const uint8_t reg = (in_reg & ~PACKET_WRITE_MASK);
-	uint16_t adc_value;
+	(void)ctx;
+	(void)reg;
 
-//	printf("read complete, is_write: %d, reg: 0x%02X\r\n", is_write, reg);
+	out_buffer[0] = VER_VAL;
+	*out_len = sizeof(uint8_t);
+}
 
-	*out_len = 0;
+static void read_key(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
 
-	switch (reg) {
+	// only the first KEY_COUNT_MASK of a deeper FIFO, see REG_ID_FST for all of them
+	out_buffer[0] = MIN(fifo_count(), KEY_COUNT_MASK);
+	*out_len = sizeof(uint8_t);
+}
 
-	// common R/W registers
-	case REG_ID_CFG:
-	case REG_ID_INT:
-	case REG_ID_DEB:
-	case REG_ID_FRQ:
-	case REG_ID_BKL:
-	case REG_ID_BK2:
-	case REG_ID_GIC:
-	case REG_ID_GIN:
-	case REG_ID_HLD:
-	case REG_ID_ADR:
-	case REG_ID_IND:
-	case REG_ID_CF2:
-	case REG_ID_DRIVER_STATE:
-	case REG_ID_SHUTDOWN_GRACE:
-	{
-		if (is_write) {
-			reg_set_value(reg, in_data);
+static void read_reset(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
+	(void)out_buffer;
+	(void)out_len;
 
-			switch (reg) {
-			case REG_ID_BKL:
-			case REG_ID_BK2:
-				backlight_sync();
-				break;
+	NVIC_SystemReset();
+}
 
-			case REG_ID_ADR:
-				puppet_i2c_sync_address();
-				break;
+static void write_reset(struct reg_context *ctx, uint8_t reg, uint8_t value)
+{
+	(void)ctx;
+	(void)reg;
+	(void)value;
 
-			default:
-				break;
-			}
-		} else {
-			out_buffer[0] = reg_get_value(reg);
-			*out_len = sizeof(uint8_t);
-		}
-		break;
-	}
+	NVIC_SystemReset();
+}
 
-	// special R/W registers
-	case REG_ID_DIR: // gpio direction
-	case REG_ID_PUE: // gpio input pull enable
-	case REG_ID_PUD: // gpio input pull direction
-	{
-		if (is_write) {
-			switch (reg) {
-			case REG_ID_DIR:
-				gpioexp_update_dir(in_data);
-				break;
-			case REG_ID_PUE:
-				gpioexp_update_pue_pud(in_data, reg_get_value(REG_ID_PUD));
-				break;
-			case REG_ID_PUD:
-				gpioexp_update_pue_pud(reg_get_value(REG_ID_PUE), in_data);
-				break;
-			}
-		} else {
-			out_buffer[0] = reg_get_value(reg);
-			*out_len = sizeof(uint8_t);
-		}
-		break;
-	}
+static void read_fifo(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
 
-	case REG_ID_GIO: // gpio value
-	{
-		if (is_write) {
-			gpioexp_set_value(in_data);
-		} else {
-			out_buffer[0] = gpioexp_get_value();
-			*out_len = sizeof(uint8_t);
-		}
-		break;
-	}
+	const uint32_t delta_us = fifo_delta_us(0);
+	const struct fifo_item item = fifo_dequeue();
 
-	// RGB LED registers
-	case REG_ID_LED_R:
-	case REG_ID_LED_G:
-	case REG_ID_LED_B:
-	{
-		if (is_write) {
-			reg_set_value(reg, in_data);
-			led_sync();
-		} else {
-			out_buffer[0] = reg_get_value(reg);
-			*out_len = sizeof(uint8_t);
-		}
-		break;
+	*out_len = put_fifo_item(out_buffer, &item, delta_us) - out_buffer;
+
+	sync_fifo_watermark();
+}
+
+static void write_gpio_config(struct reg_context *ctx, uint8_t reg, uint8_t value)
+{
+	if (!(ctx->pending_sync & SYNC_GPIO)) {
+		ctx->pending_dir = reg_get_value(REG_ID_DIR);
+		ctx->pending_pue = reg_get_value(REG_ID_PUE);
+		ctx->pending_pud = reg_get_value(REG_ID_PUD);
 	}
 
-	case REG_ID_LED: // gpio value
-	{
-		if (is_write) {
-			reg_set_value(reg, in_data);
-			led_sync();
-		} else {
-			out_buffer[0] = reg_get_value(reg);
-			*out_len = sizeof(uint8_t);
-		}
+	switch (reg) {
+	case REG_ID_DIR:
+		ctx->pending_dir = value;
+		break;
+	case REG_ID_PUE:
+		ctx->pending_pue = value;
+		break;
+	case REG_ID_PUD:
+		ctx->pending_pud = value;
 		break;
 	}
+}
 
-	// Rewake on timer
-	case REG_ID_REWAKE_MINS:
-	{
-		// Only run this if driver was loaded
-		// Otherwise, OS won't get the power key event
-		if (reg_get_value(REG_ID_DRIVER_STATE) == 0) {
-			break;
-		}
+static void read_gpio_value(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
 
-		// Get rewake and grace times in milliseconds
-		uint32_t rewake_ms = in_data * 60 * 1000;
-		uint32_t shutdown_grace_ms = MAX(
-			reg_get_value(REG_ID_SHUTDOWN_GRACE) * 1000,
-			MINIMUM_SHUTDOWN_GRACE_MS);
+	out_buffer[0] = gpioexp_get_value();
+	*out_len = sizeof(uint8_t);
+}
 
-		// Check input time against shutdown grace time
-		// Plus some slop to allow for power cycling
-		if (rewake_ms < (shutdown_grace_ms + 5000)) {
-			break;
-		}
+static void write_gpio_value(struct reg_context *ctx, uint8_t reg, uint8_t value)
+{
+	(void)reg;
+
+	ctx->pending_gio = value;
+}
+
+static void write_cf2(struct reg_context *ctx, uint8_t reg, uint8_t value)
+{
+	(void)ctx;
 
-		// Send shutdown signal to OS
-		keyboard_inject_power_key();
+#ifdef PUPPET_I2C_PIO
+	// the PIO target can't become a bus controller, Host Notify would mean no interrupts at all
+	value &= ~CF2_HOST_NOTIFY;
+#endif
 
-		// Power off with grace time to give Pi time to shut down
-		pi_schedule_power_off(shutdown_grace_ms);
+	reg_set_value(reg, value);
+}
 
-		// Schedule power on
-		pi_schedule_power_on(rewake_ms);
+static void read_adc(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
 
-		break;
+	*out_len = put_le(out_buffer, adc_read(), sizeof(uint16_t)) - out_buffer;
+}
+
+static void read_fifo_bulk(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
+
+	// items are only peeked here, see commit_fifo_bulk() for the dequeue
+	const uint8_t count = MIN(fifo_count(), (REG_BUFFER_SIZE - 1) / fifo_item_len());
+	uint8_t *out = out_buffer;
+
+	*out++ = count;
+
+	for (uint8_t i = 0; i < count; ++i) {
+		const struct fifo_item item = fifo_peek(i);
+
+		out = put_fifo_item(out, &item, fifo_delta_us(i));
 	}
 
-	// Real time clock
-	case REG_ID_RTC_SEC:
-	case REG_ID_RTC_MIN:
-	case REG_ID_RTC_HOUR:
-	case REG_ID_RTC_MDAY:
-	case REG_ID_RTC_MON:
-	case REG_ID_RTC_YEAR:
-	{
-		if (is_write) {
-			reg_set_value(reg, in_data);
+	// a forced enqueue mustn't shift them before commit_fifo_bulk() discards them
+	fifo_reserve(count);
+
+	*out_len = out - out_buffer;
+}
+
+static void commit_fifo_bulk(struct reg_context *ctx, uint8_t reg, uint8_t len)
+{
+	(void)ctx;
+	(void)reg;
+
+	// only drop the items that were fully clocked out, the count byte comes first
+	if (len > 0)
+		fifo_discard((len - 1) / fifo_item_len());
+
+	sync_fifo_watermark();
+}
+
+static void read_isr_max(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
+
+	const uint16_t cycles = MIN(puppet_i2c_get_isr_max_cycles(), UINT16_MAX);
+
+	*out_len = put_le(out_buffer, cycles, sizeof(cycles)) - out_buffer;
+}
+
+static void write_isr_max(struct reg_context *ctx, uint8_t reg, uint8_t value)
+{
+	(void)ctx;
+	(void)reg;
+	(void)value;
+
+	puppet_i2c_reset_isr_max_cycles();
+}
+
+static void read_snapshot(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)reg;
+
+	ctx->snapshot[SNAPSHOT_INT] = reg_get_value(REG_ID_INT);
+	ctx->snapshot[SNAPSHOT_KEY] = MIN(fifo_count(), KEY_COUNT_MASK);
+	ctx->snapshot[SNAPSHOT_TOX] = reg_get_value(REG_ID_TOX);
+	ctx->snapshot[SNAPSHOT_TOY] = reg_get_value(REG_ID_TOY);
+	ctx->snapshot[SNAPSHOT_GIN] = reg_get_value(REG_ID_GIN);
+
+	memcpy(out_buffer, ctx->snapshot, SNAPSHOT_LEN);
+	*out_len = SNAPSHOT_LEN;
+}
+
+static void commit_snapshot(struct reg_context *ctx, uint8_t reg, uint8_t len)
+{
+	(void)reg;
+
+	// only clear what was reported, anything that came in since stays for the next read. INT_IN2
+	// stays too, the snapshot doesn't carry REG_ID_IN2 and it's cleared once that's empty.
+	if (len > SNAPSHOT_INT)
+		reg_clear_bit(REG_ID_INT, ctx->snapshot[SNAPSHOT_INT] & ~INT_IN2);
+
+	if (len > SNAPSHOT_TOX)
+		reg_set_value(REG_ID_TOX, sub_clamped(reg_get_value(REG_ID_TOX), ctx->snapshot[SNAPSHOT_TOX]));
+
+	if (len > SNAPSHOT_TOY)
+		reg_set_value(REG_ID_TOY, sub_clamped(reg_get_value(REG_ID_TOY), ctx->snapshot[SNAPSHOT_TOY]));
+
+	if (len > SNAPSHOT_GIN)
+		reg_clear_bit(REG_ID_GIN, ctx->snapshot[SNAPSHOT_GIN]);
+
+	interrupt_sync();
+}
+
+// Rewake on timer
+static void write_rewake(struct reg_context *ctx, uint8_t reg, uint8_t value)
+{
+	(void)ctx;
+	(void)reg;
+
+	// Only run this if driver was loaded
+	// Otherwise, OS won't get the power key event
+	if (reg_get_value(REG_ID_DRIVER_STATE) == 0)
+		return;
+
+	// Get rewake and grace times in milliseconds
+	uint32_t rewake_ms = value * 60 * 1000;
+	uint32_t shutdown_grace_ms = MAX(
+		reg_get_value(REG_ID_SHUTDOWN_GRACE) * 1000,
+		MINIMUM_SHUTDOWN_GRACE_MS);
+
+	// Check input time against shutdown grace time
+	// Plus some slop to allow for power cycling
+	if (rewake_ms < (shutdown_grace_ms + 5000))
+		return;
+
+	// Send shutdown signal to OS
+	keyboard_inject_power_key();
+
+	// Power off with grace time to give Pi time to shut down
+	pi_schedule_power_off(shutdown_grace_ms);
+
+	// Schedule power on
+	pi_schedule_power_on(rewake_ms);
+}
+
+static void read_rtc(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+
+	out_buffer[0] = rtc_get(reg);
+	*out_len = sizeof(uint8_t);
+}
+
+static void commit_rtc(void)
+{
+	rtc_set(reg_get_value(REG_ID_RTC_YEAR), reg_get_value(REG_ID_RTC_MON),
+		reg_get_value(REG_ID_RTC_MDAY), reg_get_value(REG_ID_RTC_HOUR),
+		reg_get_value(REG_ID_RTC_MIN), reg_get_value(REG_ID_RTC_SEC));
+}
+
+static void read_rtc_commit(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
+	(void)out_buffer;
+	(void)out_len;
+
+	commit_rtc();
+}
+
+static void write_rtc_commit(struct reg_context *ctx, uint8_t reg, uint8_t value)
+{
+	(void)ctx;
+	(void)reg;
+	(void)value;
+
+	commit_rtc();
+}
+
+static void write_update_data(struct reg_context *ctx, uint8_t reg, uint8_t value)
+{
+	(void)ctx;
+	(void)reg;
+
+	int rc;
+
+	if ((rc = update_recv(value))) {
+
+		// More to read or update failed
+		reg_set_value(REG_ID_UPDATE_DATA, (rc < 0)
+			? (uint8_t)(-rc)
+			: UPDATE_RECV);
+
+	// Update read successfully
+	} else {
+
+		reg_set_value(REG_ID_UPDATE_DATA, UPDATE_OFF);
+
+		if (update_get_target_platform() == UPDATE_TARGET_RP2040) {
+			keyboard_inject_power_key();
+
+			uint32_t shutdown_grace_ms = MAX(
+				reg_get_value(REG_ID_SHUTDOWN_GRACE) * 1000,
+				MINIMUM_SHUTDOWN_GRACE_MS);
+			pi_schedule_power_off(shutdown_grace_ms);
+			add_alarm_in_ms(shutdown_grace_ms + 10,
+				update_commit_alarm_callback, NULL, true);
 		} else {
-			out_buffer[0] = rtc_get(reg);
-			*out_len = sizeof(uint8_t);
+			update_commit_and_reboot();
 		}
-		break;
 	}
+}
 
-	case REG_ID_RTC_COMMIT:
-	{
-		rtc_set(reg_get_value(REG_ID_RTC_YEAR), reg_get_value(REG_ID_RTC_MON),
-			reg_get_value(REG_ID_RTC_MDAY), reg_get_value(REG_ID_RTC_HOUR),
-			reg_get_value(REG_ID_RTC_MIN), reg_get_value(REG_ID_RTC_SEC));
-		break;
+static void read_update_target(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
+
+	out_buffer[0] = update_get_target_platform();
+	*out_len = sizeof(uint8_t);
+}
+
+static void write_update_target(struct reg_context *ctx, uint8_t reg, uint8_t value)
+{
+	(void)ctx;
+	(void)reg;
+
+	update_set_target_platform(value);
+}
+
+static void read_update_offset(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
+
+	*out_len = put_le(out_buffer, update_get_offset(), sizeof(uint32_t)) - out_buffer;
+}
+
+#if ENABLE_ESP32_SUPPORT
+static void read_esp32_status(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
+
+	out_buffer[0] = esp32_is_connected() ? 0x03 : 0x01;
+	*out_len = sizeof(uint8_t);
+}
+
+static void write_esp32_command(struct reg_context *ctx, uint8_t reg, uint8_t value)
+{
+	(void)ctx;
+	(void)reg;
+
+	if (esp32_is_connected())
+		esp32_send_command(value, NULL, 0);
+}
+#endif
+
+static void read_latency(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
+
+	const struct latency_stats *stats = latency_get_stats(reg_get_value(REG_ID_LAS));
+	if (!stats)
+		return;
+
+	uint8_t *out = out_buffer;
+
+	out = put_le(out, stats->count, sizeof(stats->count));
+	out = put_le(out, stats->max, sizeof(stats->max));
+
+	for (uint8_t i = 0; i < LATENCY_BUCKETS; ++i)
+		out = put_le(out, stats->buckets[i], sizeof(stats->buckets[i]));
+
+	*out_len = out - out_buffer;
+}
+
+static void read_watch_mask(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
+
+	*out_len = put_le(out_buffer, watch_get_mask(), WATCH_LEN) - out_buffer;
+}
+
+// the bytes of a block write replace the whole mask, the ones not written are 0.
+// It's applied once at the end, instead of resampling and rearming the poll for every byte.
+static void write_watch_mask(struct reg_context *ctx, uint8_t reg, uint8_t value)
+{
+	(void)reg;
+
+	if (ctx->stream_idx == 0)
+		ctx->pending_watch = 0;
+
+	if (ctx->stream_idx < WATCH_LEN)
+		ctx->pending_watch |= (uint64_t)value << (ctx->stream_idx * 8);
+}
+
+static void read_dirty(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)reg;
+
+	ctx->dirty_snapshot = watch_get_dirty();
+
+	*out_len = put_le(out_buffer, ctx->dirty_snapshot, WATCH_LEN) - out_buffer;
+}
+
+static void commit_dirty(struct reg_context *ctx, uint8_t reg, uint8_t len)
+{
+	(void)reg;
+
+	// only the bytes that made it out were seen
+	const uint64_t seen = (len >= WATCH_LEN) ? UINT64_MAX : (((uint64_t)1 << (len * 8)) - 1);
+
+	watch_clear_dirty(ctx->dirty_snapshot & seen);
+}
+
+static void read_matrix(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
+
+	*out_len = put_le(out_buffer, keyboard_get_matrix(), KEYBOARD_MATRIX_LEN) - out_buffer;
+}
+
+static void read_fifo_depth(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
+
+	*out_len = put_le(out_buffer, fifo_get_capacity(), sizeof(uint16_t)) - out_buffer;
+}
+
+// FDP and FWM are applied at the end of the write, a half written value never takes effect
+static void write_fifo_config(struct reg_context *ctx, uint8_t reg, uint8_t value)
+{
+	if (!(ctx->pending_sync & SYNC_FIFO)) {
+		ctx->pending_fifo_depth = fifo_get_capacity();
+		ctx->pending_fifo_watermark = fifo_get_watermark();
 	}
 
-	case REG_ID_UPDATE_TARGET:
-	{
-		if (is_write) {
-			update_set_target_platform(in_data);
-		} else {
-			out_buffer[0] = update_get_target_platform();
-			*out_len = sizeof(uint8_t);
-		}
+	switch (reg) {
+	case REG_ID_FDP:
+		ctx->pending_fifo_depth = stream_u16(ctx, ctx->pending_fifo_depth, value);
+		break;
+	case REG_ID_FWM:
+		ctx->pending_fifo_watermark = stream_u16(ctx, ctx->pending_fifo_watermark, value);
 		break;
 	}
+}
 
-#if ENABLE_ESP32_SUPPORT
-	case REG_ID_ESP32_STATUS:
-	{
-		if (!is_write) {
-			out_buffer[0] = esp32_is_connected() ? 0x03 : 0x01;
-			*out_len = sizeof(uint8_t);
-		}
-		break;
+static void read_fifo_watermark(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
+
+	*out_len = put_le(out_buffer, fifo_get_watermark(), sizeof(uint16_t)) - out_buffer;
+}
+
+static void read_fifo_stats(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
+
+	const struct fifo_stats *stats = fifo_get_stats();
+	uint8_t *out = out_buffer;
+
+	out = put_le(out, fifo_count(), sizeof(uint16_t));
+	out = put_le(out, stats->peak, sizeof(stats->peak));
+	out = put_le(out, stats->enqueued, sizeof(stats->enqueued));
+	out = put_le(out, stats->dropped, sizeof(stats->dropped));
+	out = put_le(out, stats->evicted_hold, sizeof(stats->evicted_hold));
+	out = put_le(out, stats->merged_pairs, sizeof(stats->merged_pairs));
+	out = put_le(out, stats->evicted_press, sizeof(stats->evicted_press));
+	out = put_le(out, stats->kept_release, sizeof(stats->kept_release));
+	out = put_le(out, stats->rejected, sizeof(stats->rejected));
+
+	*out_len = out - out_buffer;
+}
+
+static void write_fifo_stats(struct reg_context *ctx, uint8_t reg, uint8_t value)
+{
+	(void)ctx;
+	(void)reg;
+	(void)value;
+
+	fifo_reset_stats();
+}
+
+static void read_events(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
+
+	// events are only peeked here, see commit_events() for the dequeue
+	const uint8_t count = MIN(event_count(), (REG_BUFFER_SIZE - 1) / EVENT_LEN);
+	uint8_t *out = out_buffer;
+
+	*out++ = count;
+
+	for (uint8_t i = 0; i < count; ++i) {
+		const struct event event = event_peek(i);
+
+		*out++ = event.type;
+		memcpy(out, event.data, sizeof(event.data));
+		out = put_le(out + sizeof(event.data), event_delta_us(i), sizeof(uint32_t));
 	}
 
-	case REG_ID_ESP32_COMMAND:
-	{
-		if (is_write) {
-			if (esp32_is_connected()) {
-				esp32_send_command(in_data, NULL, 0);
-			}
-		}
-		break;
+	event_freeze(count);
+
+	*out_len = out - out_buffer;
+}
+
+static void commit_events(struct reg_context *ctx, uint8_t reg, uint8_t len)
+{
+	(void)ctx;
+	(void)reg;
+
+	// only drop the events that were fully clocked out, the count byte comes first
+	if (len > 0)
+		event_discard((len - 1) / EVENT_LEN);
+}
+
+static void read_key_ring_stats(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	(void)ctx;
+	(void)reg;
+
+	uint8_t *out = out_buffer;
+
+	for (uint8_t i = 0; i < KEY_RING_READERS; ++i) {
+		const struct key_ring_stats *stats = key_ring_get_stats(i);
+
+		out = put_le(out, stats->read, sizeof(stats->read));
+		out = put_le(out, stats->lost, sizeof(stats->lost));
 	}
+
+	*out_len = out - out_buffer;
+}
+
+static void write_key_ring_stats(struct reg_context *ctx, uint8_t reg, uint8_t value)
+{
+	(void)ctx;
+	(void)reg;
+	(void)value;
+
+	key_ring_reset_stats();
+}
+
+static void write_latency(struct reg_context *ctx, uint8_t reg, uint8_t value)
+{
+	(void)ctx;
+	(void)reg;
+	(void)value;
+
+	latency_reset_stats(reg_get_value(REG_ID_LAS));
+}
+
+static const struct reg_desc descs[REG_ID_LAST] =
+{
+	[REG_ID_VER]			= { REG_R,								1, 0,				read_version },
+	[REG_ID_CFG]			= { REG_RW,								1, 0 },
+	[REG_ID_INT]			= { REG_RW,								1, SYNC_INT },
+	[REG_ID_KEY]			= { REG_R,								1, 0,				read_key },
+	[REG_ID_BKL]			= { REG_RW,								1, SYNC_BACKLIGHT },
+	[REG_ID_DEB]			= { REG_RW,								1, 0 },
+	[REG_ID_FRQ]			= { REG_RW,								1, 0 },
+	[REG_ID_RST]			= { REG_RW | REG_NO_BURST | REG_NO_BLOCK,	1, 0,				read_reset, write_reset },
+	[REG_ID_FIF]			= { REG_R | REG_ATOMIC,					2, 0,				read_fifo },
+	[REG_ID_BK2]			= { REG_RW,								1, SYNC_BACKLIGHT },
+	[REG_ID_DIR]			= { REG_RW,								1, SYNC_GPIO,		NULL, write_gpio_config },
+	[REG_ID_PUE]			= { REG_RW,								1, SYNC_GPIO,		NULL, write_gpio_config },
+	[REG_ID_PUD]			= { REG_RW,								1, SYNC_GPIO,		NULL, write_gpio_config },
+	[REG_ID_GIO]			= { REG_RW,								1, SYNC_GPIO_VALUE,	read_gpio_value, write_gpio_value },
+	[REG_ID_GIC]			= { REG_RW,								1, 0 },
+	[REG_ID_GIN]			= { REG_RW,								1, 0 },
+	[REG_ID_HLD]			= { REG_RW,								1, 0 },
+	[REG_ID_ADR]			= { REG_RW,								1, SYNC_ADDRESS },
+	[REG_ID_IND]			= { REG_RW,								1, 0 },
+	[REG_ID_CF2]			= { REG_RW,								1, SYNC_INT,		NULL, write_cf2 },
+	[REG_ID_TOX]			= { REG_R | REG_READ_CLEAR | REG_ATOMIC,	1, 0 },
+	[REG_ID_TOY]			= { REG_R | REG_READ_CLEAR | REG_ATOMIC,	1, 0 },
+	[REG_ID_ADC]			= { REG_R | REG_ATOMIC,					2, 0,				read_adc },
+	[REG_ID_AIW]			= { REG_RW,								1, 0 },
+	[REG_ID_FIB]			= { REG_R | REG_ATOMIC,					1, 0,				read_fifo_bulk, NULL, commit_fifo_bulk },
+	[REG_ID_ISM]			= { REG_RW,								2, 0,				read_isr_max, write_isr_max },
+	[REG_ID_BUS]			= { REG_RW,								1, SYNC_BUS },
+	[REG_ID_SNP]			= { REG_R | REG_ATOMIC,					SNAPSHOT_LEN, 0,	read_snapshot, NULL, commit_snapshot },
+	[REG_ID_ICG]			= { REG_RW,								1, 0 },
+	[REG_ID_ICT]			= { REG_RW,								1, 0 },
+	[REG_ID_ICH]			= { REG_RW,								1, 0 },
+
+	[REG_ID_LED]			= { REG_RW,								1, SYNC_LED },
+	[REG_ID_LED_R]			= { REG_RW,								1, SYNC_LED },
+	[REG_ID_LED_G]			= { REG_RW,								1, SYNC_LED },
+	[REG_ID_LED_B]			= { REG_RW,								1, SYNC_LED },
+
+	[REG_ID_REWAKE_MINS]	= { REG_W | REG_NO_BLOCK,				1, 0,				NULL, write_rewake },
+	[REG_ID_SHUTDOWN_GRACE]	= { REG_RW,								1, 0 },
+
+	[REG_ID_RTC_SEC]		= { REG_RW,								1, 0,				read_rtc },
+	[REG_ID_RTC_MIN]		= { REG_RW,								1, 0,				read_rtc },
+	[REG_ID_RTC_HOUR]		= { REG_RW,								1, 0,				read_rtc },
+	[REG_ID_RTC_MDAY]		= { REG_RW,								1, 0,				read_rtc },
+	[REG_ID_RTC_MON]		= { REG_RW,								1, 0,				read_rtc },
+	[REG_ID_RTC_YEAR]		= { REG_RW,								1, 0,				read_rtc },
+	[REG_ID_RTC_COMMIT]		= { REG_RW | REG_NO_BURST,				1, 0,				read_rtc_commit, write_rtc_commit },
+
+	[REG_ID_DRIVER_STATE]	= { REG_RW,								1, 0 },
+	[REG_ID_STARTUP_REASON]	= { REG_R,								1, 0 },
+
+	[REG_ID_UPDATE_DATA]	= { REG_RW | REG_STREAM | REG_NO_BLOCK,	1, 0,				NULL, write_update_data },
+	[REG_ID_UPDATE_TARGET]	= { REG_RW | REG_NO_BLOCK,				1, 0,				read_update_target, write_update_target },
+#if ENABLE_ESP32_SUPPORT
+	[REG_ID_ESP32_STATUS]	= { REG_R,								1, 0,				read_esp32_status },
+	[REG_ID_ESP32_COMMAND]	= { REG_W | REG_NO_BLOCK,				1, 0,				NULL, write_esp32_command },
 #endif
+	[REG_ID_UPDATE_OFS]		= { REG_R,								4, 0,				read_update_offset },
 
-	case REG_ID_UPDATE_DATA:
-	{
-		if (is_write) {
+	[REG_ID_LAS]			= { REG_RW,								1, 0 },
+	[REG_ID_LAT]			= { REG_RW,								LAT_LEN, 0,			read_latency, write_latency },
+	[REG_ID_WCH]			= { REG_RW | REG_STREAM | REG_ATOMIC,	WATCH_LEN, SYNC_WATCH,	read_watch_mask, write_watch_mask },
+	[REG_ID_DRT]			= { REG_R | REG_ATOMIC,					WATCH_LEN, 0,		read_dirty, NULL, commit_dirty },
+	[REG_ID_IN2]			= { REG_RW,								1, 0 },
+	[REG_ID_MTX]			= { REG_R | REG_ATOMIC,					KEYBOARD_MATRIX_LEN, 0,	read_matrix },
+	[REG_ID_FDP]			= { REG_RW | REG_STREAM,				2, SYNC_FIFO,		read_fifo_depth, write_fifo_config },
+	[REG_ID_FWM]			= { REG_RW | REG_STREAM,				2, SYNC_FIFO,		read_fifo_watermark, write_fifo_config },
+	[REG_ID_FST]			= { REG_RW | REG_ATOMIC,					FST_LEN, 0,			read_fifo_stats, write_fifo_stats },
+	[REG_ID_EVQ]			= { REG_R | REG_ATOMIC,					1, 0,				read_events, NULL, commit_events },
+	[REG_ID_KRS]			= { REG_RW | REG_ATOMIC,					KRS_LEN, 0,			read_key_ring_stats, write_key_ring_stats },
+};
 
-			if ((rc = update_recv(in_data))) {
+// unknown registers don't do anything, but still take up a byte in a burst
+static const struct reg_desc no_desc = { 0, 1 };
 
-				// More to read or update failed
-				reg_set_value(REG_ID_UPDATE_DATA, (rc < 0)
-					? (uint8_t)(-rc)
-					: UPDATE_RECV);
+static const struct reg_desc *find_desc(uint8_t reg)
+{
+	return ((reg < REG_ID_LAST) && descs[reg].flags) ? &descs[reg] : &no_desc;
+}
+
+void reg_process_packet(struct reg_context *ctx, uint8_t in_reg, uint8_t in_data, uint8_t *out_buffer, uint8_t *out_len)
+{
+	const bool is_write = (in_reg & PACKET_WRITE_MASK);
+	const uint8_t reg = (in_reg & ~PACKET_WRITE_MASK);
+	const struct reg_desc *desc = find_desc(reg);
+	uint32_t irq_status = 0;
+
+//	printf("read complete, is_write: %d, reg: 0x%02X\r\n", is_write, reg);
 
-			// Update read successfully
-			} else {
+	*out_len = 0;
 
-				reg_set_value(REG_ID_UPDATE_DATA, UPDATE_OFF);
+	if (desc->flags & REG_ATOMIC)
+		irq_status = save_and_disable_interrupts();
 
-			if (update_get_target_platform() == UPDATE_TARGET_RP2040) {
-				keyboard_inject_power_key();
+	if (is_write && (desc->flags & REG_W)) {
+		if (desc->write)
+			desc->write(ctx, reg, in_data);
+		else
+			reg_set_value(reg, in_data);
 
-				uint32_t shutdown_grace_ms = MAX(
-					reg_get_value(REG_ID_SHUTDOWN_GRACE) * 1000,
-					MINIMUM_SHUTDOWN_GRACE_MS);
-				pi_schedule_power_off(shutdown_grace_ms);
-				add_alarm_in_ms(shutdown_grace_ms + 10,
-					update_commit_alarm_callback, NULL, true);
-			} else {
-				update_commit_and_reboot();
-			}
-			}
+		ctx->pending_sync |= desc->sync;
 
+		// a block keeps feeding a stream register, let it know where in the block it is
+		if (ctx->in_block && (desc->flags & REG_STREAM))
+			ctx->stream_idx++;
+		else
+			ctx->stream_idx = 0;
+	} else if (!is_write && (desc->flags & REG_R)) {
+		if (desc->read) {
+			desc->read(ctx, reg, out_buffer, out_len);
 		} else {
-			out_buffer[0] = reg_get_value(REG_ID_UPDATE_DATA);
+			out_buffer[0] = reg_get_value(reg);
 			*out_len = sizeof(uint8_t);
 		}
-		break;
+
+		if (desc->flags & REG_READ_CLEAR)
+			reg_set_value(reg, 0);
 	}
 
-	// read-only registers
-	case REG_ID_TOX:
-	case REG_ID_TOY:
-		out_buffer[0] = reg_get_value(reg);
-		*out_len = sizeof(uint8_t);
+	if (desc->flags & REG_ATOMIC)
+		restore_interrupts(irq_status);
 
-		reg_set_value(reg, 0);
-		break;
+	if (!ctx->in_block)
+		run_pending_sync(ctx);
+}
 
-	case REG_ID_VER:
-		out_buffer[0] = VER_VAL;
-		*out_len = sizeof(uint8_t);
-		break;
+uint8_t reg_block_next(uint8_t in_reg)
+{
+	const uint8_t reg = (in_reg & ~PACKET_WRITE_MASK);
 
-	case REG_ID_ADC:
-		adc_value = adc_read();
-		out_buffer[0] = (uint8_t)(adc_value & 0x00FF);
-		out_buffer[1] = (uint8_t)((adc_value & 0xFF00) >> 8);
-		*out_len = sizeof(uint8_t) * 2;
-		break;
+	if (find_desc(reg)->flags & REG_STREAM)
+		return in_reg;
 
-	case REG_ID_KEY:
-		out_buffer[0] = fifo_count();
-		*out_len = sizeof(uint8_t);
-		break;
+	// past the end, or once the block reaches a command, the data is dropped
+	if ((reg >= REG_ID_LAST) || (find_desc(reg + 1)->flags & REG_NO_BLOCK))
+		return (REG_ID_LAST | (in_reg & PACKET_WRITE_MASK));
 
-	case REG_ID_FIF:
-	{
-		struct fifo_item item = fifo_dequeue();
+	return (in_reg + 1);
+}
 
-		out_buffer[0] = ((uint8_t*)&item)[0];
-		out_buffer[1] = ((uint8_t*)&item)[1];
-		*out_len = sizeof(uint8_t) * 2;
-		break;
-	}
+void reg_begin_block(struct reg_context *ctx)
+{
+	ctx->in_block = true;
+	ctx->stream_idx = 0;
+}
 
-	case REG_ID_RST:
-		NVIC_SystemReset();
-		break;
+void reg_end_block(struct reg_context *ctx)
+{
+	ctx->in_block = false;
 
-	case REG_ID_STARTUP_REASON:
-		out_buffer[0] = reg_get_value(reg);
-		*out_len = sizeof(uint8_t);
-		break;
+	run_pending_sync(ctx);
+}
+
+void reg_process_burst(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len)
+{
+	const struct reg_desc *desc = find_desc(reg);
+
+	if (desc->flags & REG_NO_BURST)
+		*out_len = 0;
+	else
+		reg_process_packet(ctx, reg, 0, out_buffer, out_len);
+
+	// write-only registers still take up their width so the host can compute offsets
+	if (*out_len == 0) {
+		memset(out_buffer, 0x00, desc->width);
+		*out_len = desc->width;
 	}
 }
 
+void reg_commit_read(struct reg_context *ctx, uint8_t reg, uint8_t len)
+{
+	const struct reg_desc *desc = find_desc(reg);
+	uint32_t irq_status = 0;
+
+	if (!desc->commit)
+		return;
+
+	if (desc->flags & REG_ATOMIC)
+		irq_status = save_and_disable_interrupts();
+
+	desc->commit(ctx, reg, len);
+
+	if (desc->flags & REG_ATOMIC)
+		restore_interrupts(irq_status);
+}
+
 uint8_t reg_get_value(enum reg_id reg)
 {
 	return self.regs[reg];
@@ -344,7 +960,12 @@ void reg_set_value(enum reg_id reg, uint8_t value)
 	printf("%s: reg: 0x%02X, val: 0x%02X (%d)\r\n", __func__, reg, value, value);
 #endif
 
+	if (self.regs[reg] == value)
+		return;
+
 	self.regs[reg] = value;
+
+	watch_mark(reg);
 }
 
 bool reg_is_bit_set(enum reg_id reg, uint8_t bit)
@@ -358,7 +979,12 @@ void reg_set_bit(enum reg_id reg, uint8_t bit)
 	printf("%s: reg: 0x%02X, bit: %d\r\n", __func__, reg, bit);
 #endif
 
+	if ((self.regs[reg] & bit) == bit)
+		return;
+
 	self.regs[reg] |= bit;
+
+	watch_mark(reg);
 }
 
 void reg_clear_bit(enum reg_id reg, uint8_t bit)
@@ -367,7 +993,12 @@ void reg_clear_bit(enum reg_id reg, uint8_t bit)
 	printf("%s: reg: 0x%02X, bit: %d\r\n", __func__, reg, bit);
 #endif
 
+	if (!(self.regs[reg] & bit))
+		return;
+
 	self.regs[reg] &= ~bit;
+
+	watch_mark(reg);
 }
 
 void reg_init(void)
@@ -381,6 +1012,9 @@ void reg_init(void)
 	reg_set_value(REG_ID_HLD, 100);	// 10ms units
 	reg_set_value(REG_ID_ADR, 0x1F);
 	reg_set_value(REG_ID_IND, 1);	// ms
+	reg_set_value(REG_ID_ICG, 10);	// ms
+	reg_set_value(REG_ID_ICT, 1);
+	reg_set_value(REG_ID_ICH, 10);	// ms
 	reg_set_value(REG_ID_CF2, CF2_TOUCH_INT | CF2_USB_KEYB_ON | CF2_USB_MOUSE_ON);
 	reg_set_value(REG_ID_DRIVER_STATE, 0); // Driver not yet loaded
 
@@ -29,6 +29,15 @@ enum reg_id
 	REG_ID_TOY = 0x16, // touch delta y since last read, at most (-128 to 127)
 
 	REG_ID_ADC = 0x17,
+	REG_ID_AIW = 0x18, // burst read auto-increment window (0 = disabled)
+	REG_ID_FIB = 0x19, // key fifo bulk drain (count followed by items)
+	REG_ID_ISM = 0x1A, // longest puppet i2c irq handler run, in cpu cycles (write to reset)
+	REG_ID_BUS = 0x1B, // puppet and touchpad i2c bus speeds
+	REG_ID_SNP = 0x1C, // consistent snapshot of INT, KEY, TOX, TOY and GIN, cleared once read
+	REG_ID_ICG = 0x1D, // minimum gap between interrupt pulses, in ms
+	REG_ID_ICT = 0x1E, // number of events that triggers an interrupt pulse right away
+	REG_ID_ICH = 0x1F, // longest an event waits for REG_ID_ICT more, in ms
+
 	REG_ID_LED    = 0x20,
 	REG_ID_LED_R  = 0x21,
 	REG_ID_LED_G  = 0x22,
@@ -53,6 +62,19 @@ enum reg_id
 	REG_ID_UPDATE_TARGET = 0x31, // Target platform for firmware update (RP2040/ESP32)
 	REG_ID_ESP32_STATUS = 0x32,  // ESP32 status register (presence, connection state)
 	REG_ID_ESP32_COMMAND = 0x33, // ESP32 command register
+	REG_ID_UPDATE_OFS = 0x34, // Number of update bytes accepted since the '+' header
+
+	REG_ID_LAS = 0x35, // latency class REG_ID_LAT reports (see enum latency_class)
+	REG_ID_LAT = 0x36, // latency statistics of the selected class (write to reset)
+	REG_ID_WCH = 0x37, // mask of registers to watch for changes, bit n is register n
+	REG_ID_DRT = 0x38, // watched registers that changed, cleared once read
+	REG_ID_IN2 = 0x39, // interrupt status 2, see INT_IN2
+	REG_ID_MTX = 0x3A, // raw key matrix and buttons, see keyboard_get_matrix()
+	REG_ID_FDP = 0x3B, // FIFO depth, 16 bits
+	REG_ID_FWM = 0x3C, // FIFO high watermark for IN2_FIFO_WM, 16 bits, 0 is off
+	REG_ID_FST = 0x3D, // FIFO statistics (write to reset)
+	REG_ID_EVQ = 0x3E, // typed event queue, see event.h
+	REG_ID_KRS = 0x3F, // key ring reader statistics (write to reset), see key_ring.h
 
 	REG_ID_LAST,
 };
@@ -69,6 +91,11 @@ enum reg_id
 #define CF2_TOUCH_INT		(1 << 0) // Should touch events generate interrupts
 #define CF2_USB_KEYB_ON		(1 << 1) // Should key events be sent over USB HID
 #define CF2_USB_MOUSE_ON	(1 << 2) // Should touch events be sent over USB HID
+#define CF2_INT_LEVEL		(1 << 3) // Should INT stay asserted until REG_ID_INT is cleared, instead of pulsing
+#define CF2_FIFO_V2			(1 << 4) // Should FIFO reads carry modifiers, source and a timestamp delta
+#define CF2_HOST_NOTIFY		(1 << 5) // Should interrupts be sent as SMBus Host Notify messages, instead of on INT
+#define CF2_USB_MATRIX		(1 << 6) // Should key matrix changes be streamed over the USB vendor interface
+#define CF2_EVENTS			(1 << 7) // Should inputs be queued as typed events for REG_ID_EVQ
 // TODO? CF2_STICKY_MODS // Pressing and releasing a mod affects next key pressed
 
 #define INT_OVERFLOW		(1 << 0)
@@ -78,12 +105,19 @@ enum reg_id
 #define INT_PANIC			(1 << 4)
 #define INT_GPIO			(1 << 5)
 #define INT_TOUCH			(1 << 6)
-// Future me: If we need more INT_*, add a INT2 and use (1 << 7) here as indicator that the info is in INT2
+#define INT_IN2				(1 << 7) // More in REG_ID_IN2
+
+#define IN2_WATCH			(1 << 0) // A watched register changed, see REG_ID_DRT
+#define IN2_FIFO_WM			(1 << 1) // The FIFO filled up to REG_ID_FWM
+#define IN2_EVENT			(1 << 2) // There are events in REG_ID_EVQ
 
 #define KEY_CAPSLOCK		(1 << 5) // Caps lock status
 #define KEY_NUMLOCK			(1 << 6) // Num lock status
 #define KEY_COUNT_MASK		0x1F
 
+#define BUS_PUPPET_SPEED(x)	(((x) >> 0) & 0x03) // see enum i2c_speed
+#define BUS_TOUCH_SPEED(x)	(((x) >> 2) & 0x03)
+
 #define DIR_OUTPUT			0
 #define DIR_INPUT			1
 
@@ -94,7 +128,59 @@ enum reg_id
 
 #define PACKET_WRITE_MASK	(1 << 7)
 
-void reg_process_packet(uint8_t in_reg, uint8_t in_data, uint8_t *out_buffer, uint8_t *out_len);
+#define REG_BUFFER_SIZE		64 // largest amount of data a single register read can return
+
+enum snapshot_field
+{
+	SNAPSHOT_INT = 0,
+	SNAPSHOT_KEY,
+	SNAPSHOT_TOX,
+	SNAPSHOT_TOY,
+	SNAPSHOT_GIN,
+
+	SNAPSHOT_LEN,
+};
+
+// State of one host interface talking to the registers, each transport owns one so their
+// block writes and snapshots don't get mixed up when they're accessed at the same time
+struct reg_context
+{
+	bool in_block;
+	uint16_t pending_sync;
+
+	// gpio settings written since the last sync, DIR/PUE/PUD are applied together
+	uint8_t pending_dir;
+	uint8_t pending_pue;
+	uint8_t pending_pud;
+	uint8_t pending_gio;
+
+	// same for the 16 bit FIFO depth and watermark, so both their bytes are applied at once
+	uint16_t pending_fifo_depth;
+	uint16_t pending_fifo_watermark;
+
+	// and the REG_ID_WCH mask, its bytes are collected until the end of the write
+	uint64_t pending_watch;
+
+	// bytes written to a stream register so far in the current block
+	uint8_t stream_idx;
+
+	// what the last REG_ID_SNP read reported, cleared once it's been clocked out
+	uint8_t snapshot[SNAPSHOT_LEN];
+
+	// same for REG_ID_DRT
+	uint64_t dirty_snapshot;
+};
+
+void reg_process_packet(struct reg_context *ctx, uint8_t in_reg, uint8_t in_data, uint8_t *out_buffer, uint8_t *out_len);
+void reg_process_burst(struct reg_context *ctx, uint8_t reg, uint8_t *out_buffer, uint8_t *out_len);
+void reg_commit_read(struct reg_context *ctx, uint8_t reg, uint8_t len);
+
+// Register the next byte of a block write goes to
+uint8_t reg_block_next(uint8_t in_reg);
+
+// Writes between these are applied together, subsystems only pick up the new values at the end
+void reg_begin_block(struct reg_context *ctx);
+void reg_end_block(struct reg_context *ctx);
 
 uint8_t reg_get_value(enum reg_id reg);
 void reg_set_value(enum reg_id reg, uint8_t value);
@@ -22,7 +22,7 @@ static int dow(int year, int month, int day)
 	return (zeller (year, month, day) % 7);
 }
 
-void rtc_set(uint8_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t min, uint8_t sec)
+void rtc_set(uint16_t year, uint8_t month, uint8_t day, uint8_t hour, uint8_t min, uint8_t sec)
 {
 	datetime_t t;
 	t.year = year + 1900;
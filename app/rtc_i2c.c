@@ -0,0 +1,158 @@
+#include "rtc_i2c.h"
+
+#include "rtc.h"
+
+#include <hardware/rtc.h>
+#include <pico/stdlib.h>
+#include <string.h>
+
+// DS3231 registers, everything in BCD
+#define REG_SECONDS			0x00
+#define REG_MINUTES			0x01
+#define REG_HOURS			0x02
+#define REG_DAY				0x03 // day of the week, 1-7
+#define REG_DATE			0x04
+#define REG_MONTH			0x05
+#define REG_YEAR			0x06
+#define REG_CONTROL			0x0E
+#define REG_STATUS			0x0F
+#define REG_COUNT			0x13 // the register pointer wraps around after the temperature
+
+#define TIME_REGS			(REG_YEAR + 1)
+
+#define HOURS_12H			(1 << 6)
+#define HOURS_PM			(1 << 5)
+#define MONTH_CENTURY		(1 << 7)
+
+// oscillator stopped, set for as long as the RTC hasn't been set since boot
+#define STATUS_OSF			(1 << 7)
+
+#define CONTROL_DEFAULT		0x1C
+
+static struct
+{
+	uint8_t pointer;
+
+	// alarms, control, status and aging are only stored, the temperature reads as 0
+	uint8_t regs[REG_COUNT];
+} self =
+{
+	.regs =
+	{
+		[REG_CONTROL] = CONTROL_DEFAULT,
+	},
+};
+
+static uint8_t to_bcd(uint8_t value)
+{
+	return ((value / 10) << 4) | (value % 10);
+}
+
+static uint8_t from_bcd(uint8_t value)
+{
+	return ((value >> 4) * 10) + (value & 0x0F);
+}
+
+// the time registers of a single datetime, so a burst read can't tear
+static void read_time(uint8_t *regs)
+{
+	datetime_t t = { 0 };
+
+	rtc_get_datetime(&t);
+
+	// 2000-2099 without the century bit, 2100-2199 with it
+	const int year = t.year - 2000;
+
+	regs[REG_SECONDS] = to_bcd(t.sec);
+	regs[REG_MINUTES] = to_bcd(t.min);
+	regs[REG_HOURS] = to_bcd(t.hour);
+	regs[REG_DAY] = t.dotw + 1;
+	regs[REG_DATE] = to_bcd(t.day);
+	regs[REG_MONTH] = to_bcd(t.month) | ((year >= 100) ? MONTH_CENTURY : 0);
+	regs[REG_YEAR] = to_bcd(MAX(year, 0) % 100);
+}
+
+static void write_time(const uint8_t *regs)
+{
+	uint8_t hour = from_bcd(regs[REG_HOURS] & 0x3F);
+
+	if (regs[REG_HOURS] & HOURS_12H) {
+		hour = from_bcd(regs[REG_HOURS] & 0x1F) % 12;
+
+		if (regs[REG_HOURS] & HOURS_PM)
+			hour += 12;
+	}
+
+	// rtc_set() takes years since 1900
+	const uint16_t year = 100 + from_bcd(regs[REG_YEAR]) + ((regs[REG_MONTH] & MONTH_CENTURY) ? 100 : 0);
+
+	rtc_set(year, from_bcd(regs[REG_MONTH] & 0x1F), from_bcd(regs[REG_DATE] & 0x3F),
+		hour, from_bcd(regs[REG_MINUTES] & 0x7F), from_bcd(regs[REG_SECONDS] & 0x7F));
+}
+
+static void rtc_receive(const uint8_t *data, uint8_t len)
+{
+	if (len == 0)
+		return;
+
+	self.pointer = data[0] % REG_COUNT;
+
+	// the written time registers are merged into the current time and set at once
+	uint8_t time[TIME_REGS];
+	bool time_written = false;
+
+	read_time(time);
+
+	for (uint8_t i = 1; i < len; ++i) {
+		if (self.pointer < TIME_REGS) {
+			time[self.pointer] = data[i];
+			time_written = true;
+		} else if (self.pointer == REG_STATUS) {
+			// OSF can only be cleared, and only by setting the time
+			self.regs[REG_STATUS] = data[i] & ~STATUS_OSF;
+		} else {
+			self.regs[self.pointer] = data[i];
+		}
+
+		self.pointer = (self.pointer + 1) % REG_COUNT;
+	}
+
+	if (time_written)
+		write_time(time);
+}
+
+static uint8_t rtc_request(uint8_t *data, uint8_t size)
+{
+	uint8_t regs[REG_COUNT];
+
+	memcpy(regs, self.regs, sizeof(regs));
+	read_time(regs);
+
+	if (!rtc_running())
+		regs[REG_STATUS] |= STATUS_OSF;
+
+	// one round from the pointer on, that's all a driver ever reads
+	const uint8_t len = MIN(size, REG_COUNT);
+
+	for (uint8_t i = 0; i < len; ++i)
+		data[i] = regs[(self.pointer + i) % REG_COUNT];
+
+	return len;
+}
+
+static void rtc_sent(uint8_t len)
+{
+	self.pointer = (self.pointer + len) % REG_COUNT;
+}
+
+static const struct pio_i2c_target_handler handler =
+{
+	.receive = rtc_receive,
+	.request = rtc_request,
+	.sent = rtc_sent,
+};
+
+const struct pio_i2c_target_handler *rtc_i2c_get_handler(void)
+{
+	return &handler;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include "pio_i2c_target.h"
+
+// where a DS3231 answers, so the stock rtc-ds1307 driver picks it up
+#define RTC_I2C_ADDRESS		0x68
+
+// DS3231 compatible view of the RTC, see PUPPET_I2C_RTC in the board file
+const struct pio_i2c_target_handler *rtc_i2c_get_handler(void);
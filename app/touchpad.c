@@ -1,6 +1,8 @@
 #include "touchpad.h"
 
+#include "i2c_speed.h"
 #include "keyboard.h"
+#include "reg.h"
 
 #include <hardware/i2c.h>
 #include <pico/binary_info.h>
@@ -40,6 +42,9 @@ static struct
 	struct touch_callback *callbacks;
 	uint32_t last_swipe_time;
 	i2c_inst_t *i2c;
+
+	// REG_BUS changed the speed, applied before the next transfer
+	volatile bool speed_changed;
 } self;
 
 static uint8_t read_register8(uint8_t reg)
@@ -52,6 +57,11 @@ static uint8_t read_register8(uint8_t reg)
 	return val;
 }
 
+static void apply_speed(void)
+{
+	i2c_speed_apply(self.i2c, PIN_SDA, PIN_SCL, BUS_TOUCH_SPEED(reg_get_value(REG_ID_BUS)));
+}
+
 //static void write_register8(uint8_t reg, uint8_t val)
 //{
 //	uint8_t buffer[2] = { reg, val };
@@ -77,6 +87,11 @@ void touchpad_gpio_irq(uint gpio, uint32_t events)
 	if (!(events & GPIO_IRQ_EDGE_FALL))
 		return;
 
+	if (self.speed_changed) {
+		self.speed_changed = false;
+		apply_speed();
+	}
+
 	const uint8_t motion = read_register8(REG_MOTION);
 	if (motion & BIT_MOTION_MOT) {
 		int8_t x = read_register8(REG_DELTA_X);
@@ -97,6 +112,12 @@ void touchpad_gpio_irq(uint gpio, uint32_t events)
 	}
 }
 
+void touchpad_sync_speed(void)
+{
+	// this can run from an irq that preempted a transfer in the gpio irq, so leave it to that one
+	self.speed_changed = true;
+}
+
 void touchpad_add_touch_callback(struct touch_callback *callback)
 {
 	// first callback
@@ -118,7 +139,7 @@ void touchpad_init(void)
 	// determine the instance based on SCL pin, hope you didn't screw up the SDA pin!
 	self.i2c = i2c_instances[(PIN_SCL / 2) % 2];
 
-	i2c_init(self.i2c, 100 * 1000);
+	i2c_init(self.i2c, i2c_speed_to_baudrate(BUS_TOUCH_SPEED(reg_get_value(REG_ID_BUS))));
 
 	gpio_set_function(PIN_SDA, GPIO_FUNC_I2C);
 	gpio_pull_up(PIN_SDA);
@@ -126,6 +147,8 @@ void touchpad_init(void)
 	gpio_set_function(PIN_SCL, GPIO_FUNC_I2C);
 	gpio_pull_up(PIN_SCL);
 
+	apply_speed();
+
 	// Make the I2C pins available to picotool
 	bi_decl(bi_2pins_with_func(PIN_SDA, PIN_SCL, GPIO_FUNC_I2C));
 
@@ -11,6 +11,8 @@ struct touch_callback
 
 void touchpad_gpio_irq(uint gpio, uint32_t events);
 
+void touchpad_sync_speed(void);
+
 void touchpad_add_touch_callback(struct touch_callback *callback);
 
 void touchpad_init(void);
@@ -182,6 +182,7 @@ static size_t update_line_idx = 0;
 static struct hex_record update_record;
 static size_t flashbuf_offset = 0;
 static uint8_t update_reading_header = 0;
+static uint32_t update_offset = 0;
 
 uint8_t update_get_target_platform(void)
 {
@@ -217,7 +218,12 @@ void update_init(void)
 #endif
 }
 
-int update_recv(uint8_t b)
+uint32_t update_get_offset(void)
+{
+    return update_offset;
+}
+
+static int recv_byte(uint8_t b)
 {
     if (update_target_platform == UPDATE_TARGET_RP2040) {
         int rc;
@@ -301,6 +307,22 @@ int update_recv(uint8_t b)
     }
 }
 
+int update_recv(uint8_t b)
+{
+    const int rc = recv_byte(b);
+
+    // The header restarts the stream and is its first byte
+    if (b == '+') {
+        update_offset = 0;
+    }
+
+    if (rc >= 0) {
+        update_offset++;
+    }
+
+    return rc;
+}
+
 void update_commit_and_reboot(void)
 {
     if (update_target_platform == UPDATE_TARGET_RP2040) {
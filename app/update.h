@@ -24,5 +24,8 @@ void update_init(void);
 // Return 0 when complete firmware received
 int update_recv(uint8_t b);
 
+// Number of bytes accepted since the last '+' header
+uint32_t update_get_offset(void);
+
 // Flash received firmware
 void update_commit_and_reboot(void);
@@ -1,6 +1,8 @@
 #include "usb.h"
 
 #include "backlight.h"
+#include "fifo.h"
+#include "key_ring.h"
 #include "keyboard.h"
 #include "touchpad.h"
 #include "reg.h"
@@ -12,42 +14,98 @@
 #define USB_LOW_PRIORITY_IRQ	31
 #define USB_TASK_INTERVAL_US	1000
 
+// What CF2_USB_MATRIX streams on the vendor interface, each message is the register it's from
+// followed by its value: REG_ID_MTX and the matrix, or REG_ID_FIF and a key event in the v2 format
+#define STREAM_MATRIX_LEN		(1 + KEYBOARD_MATRIX_LEN)
+#define STREAM_KEY_LEN			(1 + FIFO_ITEM_V2_LEN)
+
 static struct
 {
 	mutex_t mutex;
 	bool mouse_moved;
 	uint8_t mouse_btn;
 
-	uint8_t write_buffer[2];
+	struct reg_context reg;
+	uint8_t write_buffer[REG_BUFFER_SIZE];
 	uint8_t write_len;
+
+	// last key matrix streamed with CF2_USB_MATRIX, and whether it's still valid
+	uint64_t streamed_matrix;
+	bool matrix_streamed;
+
+	// when the last streamed key event happened
+	uint32_t streamed_key_us;
 } self;
 
 // TODO: What about Ctrl?
 // TODO: What should L1, L2, R1, R2 do
 // TODO: Should touch send arrow keys as an option?
 
-static void low_priority_worker_irq(void)
+static void stream_matrix(void)
 {
-	if (mutex_try_enter(&self.mutex, NULL)) {
-		tud_task();
-
-		mutex_exit(&self.mutex);
+	if (!reg_is_bit_set(REG_ID_CF2, CF2_USB_MATRIX) || !tud_vendor_n_mounted(0)) {
+		self.matrix_streamed = false;
+		return;
 	}
+
+	const uint64_t matrix = keyboard_get_matrix();
+
+	if (self.matrix_streamed && (matrix == self.streamed_matrix))
+		return;
+
+	// try again on the next run rather than sending half of it
+	if (tud_vendor_n_write_available(0) < STREAM_MATRIX_LEN)
+		return;
+
+	uint8_t buff[STREAM_MATRIX_LEN] = { REG_ID_MTX };
+
+	for (uint8_t i = 0; i < KEYBOARD_MATRIX_LEN; ++i)
+		buff[1 + i] = (uint8_t)(matrix >> (i * 8));
+
+	tud_vendor_n_write(0, buff, sizeof(buff));
+
+	self.streamed_matrix = matrix;
+	self.matrix_streamed = true;
 }
 
-static int64_t timer_task(alarm_id_t id, void *user_data)
+static void stream_keys(void)
 {
-	(void)id;
-	(void)user_data;
+	struct fifo_item item;
 
-	irq_set_pending(USB_LOW_PRIORITY_IRQ);
+	// like the matrix, only what happens while the stream is on
+	if (!reg_is_bit_set(REG_ID_CF2, CF2_USB_MATRIX) || !tud_vendor_n_mounted(0)) {
+		while (key_ring_peek(KEY_RING_USB_VENDOR, &item))
+			key_ring_skip(KEY_RING_USB_VENDOR);
 
-	return USB_TASK_INTERVAL_US;
+		return;
+	}
+
+	while ((tud_vendor_n_write_available(0) >= STREAM_KEY_LEN) && key_ring_peek(KEY_RING_USB_VENDOR, &item)) {
+		const uint32_t delta_us = item.time_us - self.streamed_key_us;
+		const uint8_t buff[STREAM_KEY_LEN] =
+		{
+			REG_ID_FIF,
+			item.scancode,
+			item.state,
+			item.mods,
+			item.source,
+			(uint8_t)delta_us,
+			(uint8_t)(delta_us >> 8),
+			(uint8_t)(delta_us >> 16),
+			(uint8_t)(delta_us >> 24),
+		};
+
+		tud_vendor_n_write(0, buff, sizeof(buff));
+
+		self.streamed_key_us = item.time_us;
+
+		key_ring_skip(KEY_RING_USB_VENDOR);
+	}
 }
 
-static void key_cb(uint8_t key, enum key_state state)
+static void send_key(uint8_t key, enum key_state state)
 {
-	if (tud_hid_n_ready(USB_ITF_KEYBOARD) && reg_is_bit_set(REG_ID_CF2, CF2_USB_KEYB_ON)) {
+	if (reg_is_bit_set(REG_ID_CF2, CF2_USB_KEYB_ON)) {
 		uint8_t keycode[6] = { 0 };
 		uint8_t modifiers = 0;
 
@@ -60,7 +118,7 @@ static void key_cb(uint8_t key, enum key_state state)
 		}
 	}
 
-	if (tud_hid_n_ready(USB_ITF_MOUSE) && reg_is_bit_set(REG_ID_CF2, CF2_USB_MOUSE_ON)) {
+	if (reg_is_bit_set(REG_ID_CF2, CF2_USB_MOUSE_ON)) {
 		if (key == KEY_COMPOSE) {
 			if (state == KEY_STATE_PRESSED) {
 				self.mouse_btn = MOUSE_BUTTON_LEFT;
@@ -76,7 +134,58 @@ static void key_cb(uint8_t key, enum key_state state)
 		}
 	}
 }
-static struct key_callback key_callback = { .func = key_cb };
+
+// one key event per run, whenever the reports it turns into can go out
+static void drain_keys(void)
+{
+	struct fifo_item item;
+
+	// nothing from before the host was there, it would only see stale keys
+	if (!tud_mounted()) {
+		while (key_ring_peek(KEY_RING_USB_HID, &item))
+			key_ring_skip(KEY_RING_USB_HID);
+
+		return;
+	}
+
+	if (!key_ring_peek(KEY_RING_USB_HID, &item))
+		return;
+
+	if (reg_is_bit_set(REG_ID_CF2, CF2_USB_KEYB_ON) && !tud_hid_n_ready(USB_ITF_KEYBOARD))
+		return;
+
+	if (reg_is_bit_set(REG_ID_CF2, CF2_USB_MOUSE_ON) && (item.scancode == KEY_COMPOSE) && !tud_hid_n_ready(USB_ITF_MOUSE))
+		return;
+
+	send_key(item.scancode, item.state);
+
+	key_ring_skip(KEY_RING_USB_HID);
+}
+
+static void low_priority_worker_irq(void)
+{
+	if (mutex_try_enter(&self.mutex, NULL)) {
+		tud_task();
+
+		drain_keys();
+
+		stream_keys();
+
+		stream_matrix();
+
+		mutex_exit(&self.mutex);
+	}
+}
+
+static int64_t timer_task(alarm_id_t id, void *user_data)
+{
+	(void)id;
+	(void)user_data;
+
+	irq_set_pending(USB_LOW_PRIORITY_IRQ);
+
+	return USB_TASK_INTERVAL_US;
+}
 
 static void touch_cb(int8_t x, int8_t y)
 {
@@ -116,12 +225,28 @@ void tud_vendor_rx_cb(uint8_t itf)
 //	printf("%s: itf: %d, avail: %d\r\n", __func__, itf, tud_vendor_n_available(itf));
 
 	uint8_t buff[64] = { 0 };
-	tud_vendor_n_read(itf, buff, 64);
+	const uint32_t len = tud_vendor_n_read(itf, buff, 64);
 //	printf("%s: %02X %02X %02X\r\n", __func__, buff[0], buff[1], buff[2]);
 
-	reg_process_packet(buff[0], buff[1], self.write_buffer, &self.write_len);
+	if ((buff[0] & PACKET_WRITE_MASK) && (len > 2)) {
+		// block write, same as over I2C
+		uint8_t reg = buff[0];
+
+		reg_begin_block(&self.reg);
+
+		for (uint32_t i = 1; i < len; ++i) {
+			reg_process_packet(&self.reg, reg, buff[i], self.write_buffer, &self.write_len);
+			reg = reg_block_next(reg);
+		}
+
+		reg_end_block(&self.reg);
+	} else {
+		reg_process_packet(&self.reg, buff[0], buff[1], self.write_buffer, &self.write_len);
+	}
+
+	const uint32_t written = tud_vendor_n_write(itf, self.write_buffer, self.write_len);
 
-	tud_vendor_n_write(itf, self.write_buffer, self.write_len);
+	reg_commit_read(&self.reg, buff[0] & ~PACKET_WRITE_MASK, written);
 }
 
 void tud_mount_cb(void)
@@ -139,8 +264,6 @@ void usb_init(void)
 {
 	tusb_init();
 
-	keyboard_add_key_callback(&key_callback);
-
 	touchpad_add_touch_callback(&touch_callback);
 
 	// create a new interrupt that calls tud_task, and trigger that interrupt from a timer
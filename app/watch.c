@@ -0,0 +1,167 @@
+#include "watch.h"
+
+#include "gpioexp.h"
+#include "interrupt.h"
+#include "reg.h"
+#include "rtc.h"
+
+#include <hardware/adc.h>
+#include <hardware/sync.h>
+#include <pico/stdlib.h>
+#include <stdlib.h>
+
+// registers backed by hardware instead of a stored value are sampled this often
+#define POLL_INTERVAL_MS	1000
+
+// the battery reading is noisy, smaller changes than this (in ADC counts) don't count
+#define ADC_THRESHOLD		16
+
+#define BIT(reg)			((uint64_t)1 << (reg))
+
+// these signal the change themselves, watching them would only loop back
+#define UNWATCHABLE			(BIT(REG_ID_INT) | BIT(REG_ID_IN2) | BIT(REG_ID_WCH) | BIT(REG_ID_DRT))
+
+#define RTC_REGS			(BIT(REG_ID_RTC_SEC) | BIT(REG_ID_RTC_MIN) | BIT(REG_ID_RTC_HOUR) | \
+							 BIT(REG_ID_RTC_MDAY) | BIT(REG_ID_RTC_MON) | BIT(REG_ID_RTC_YEAR))
+
+// the hardware backed ones, the others are marked by whatever changes them
+#define POLLED_REGS			(BIT(REG_ID_ADC) | RTC_REGS)
+
+_Static_assert(REG_ID_LAST <= 64, "watch masks only cover 64 registers");
+
+static struct
+{
+	uint64_t mask;
+	uint64_t dirty;
+
+	// the poll alarm is armed, only while a polled register is watched
+	bool polling;
+
+	// last sampled values of the hardware backed registers
+	uint16_t adc;
+	uint8_t rtc[REG_ID_RTC_YEAR - REG_ID_RTC_SEC + 1];
+} self;
+
+void watch_mark(uint8_t reg)
+{
+	if (!(self.mask & BIT(reg)))
+		return;
+
+	const uint32_t irq_status = save_and_disable_interrupts();
+
+	const bool was_clean = (self.dirty == 0);
+	self.dirty |= BIT(reg);
+
+	restore_interrupts(irq_status);
+
+	// one interrupt until the host has read REG_ID_DRT, no matter how many change in between
+	if (!was_clean)
+		return;
+
+	reg_set_bit(REG_ID_IN2, IN2_WATCH);
+	reg_set_bit(REG_ID_INT, INT_IN2);
+
+	interrupt_trigger();
+}
+
+static void sample(void)
+{
+	if (self.mask & BIT(REG_ID_ADC))
+		self.adc = adc_read();
+
+	for (uint8_t reg = REG_ID_RTC_SEC; reg <= REG_ID_RTC_YEAR; ++reg) {
+		if (self.mask & BIT(reg))
+			self.rtc[reg - REG_ID_RTC_SEC] = rtc_get(reg);
+	}
+}
+
+static int64_t poll_task(alarm_id_t id, void *user_data)
+{
+	(void)id;
+	(void)user_data;
+
+	// nothing to poll anymore, watch_set_mask() arms it again
+	if (!(self.mask & POLLED_REGS)) {
+		self.polling = false;
+		return 0;
+	}
+
+	if (self.mask & BIT(REG_ID_ADC)) {
+		const uint16_t adc = adc_read();
+
+		if (abs(adc - self.adc) >= ADC_THRESHOLD) {
+			self.adc = adc;
+			watch_mark(REG_ID_ADC);
+		}
+	}
+
+	if (self.mask & RTC_REGS) {
+		for (uint8_t reg = REG_ID_RTC_SEC; reg <= REG_ID_RTC_YEAR; ++reg) {
+			const uint8_t value = rtc_get(reg);
+
+			if (value != self.rtc[reg - REG_ID_RTC_SEC]) {
+				self.rtc[reg - REG_ID_RTC_SEC] = value;
+				watch_mark(reg);
+			}
+		}
+	}
+
+	// negative value means interval since last alarm time
+	return -(POLL_INTERVAL_MS * 1000);
+}
+
+static void gpioexp_cb(uint8_t gpio, uint8_t gpio_idx)
+{
+	(void)gpio;
+	(void)gpio_idx;
+
+	watch_mark(REG_ID_GIO);
+}
+static struct gpioexp_callback gpioexp_callback = { .func = gpioexp_cb };
+
+void watch_set_mask(uint64_t mask)
+{
+	self.mask = mask & ~UNWATCHABLE;
+
+	// only changes from now on count
+	sample();
+
+	if ((self.mask & POLLED_REGS) && !self.polling)
+		self.polling = (add_alarm_in_ms(POLL_INTERVAL_MS, poll_task, NULL, true) > 0);
+}
+
+uint64_t watch_get_mask(void)
+{
+	return self.mask;
+}
+
+uint64_t watch_get_dirty(void)
+{
+	return self.dirty;
+}
+
+void watch_clear_dirty(uint64_t bits)
+{
+	const uint32_t irq_status = save_and_disable_interrupts();
+
+	self.dirty &= ~bits;
+
+	const bool clean = (self.dirty == 0);
+
+	restore_interrupts(irq_status);
+
+	if (!clean)
+		return;
+
+	reg_clear_bit(REG_ID_IN2, IN2_WATCH);
+
+	if (reg_get_value(REG_ID_IN2) == 0)
+		reg_clear_bit(REG_ID_INT, INT_IN2);
+
+	interrupt_sync();
+}
+
+void watch_init(void)
+{
+	gpioexp_add_int_callback(&gpioexp_callback);
+}
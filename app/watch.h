@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+// Bit n of the masks stands for register n, REG_ID_WCH and REG_ID_DRT are this many bytes (little endian)
+#define WATCH_LEN		sizeof(uint64_t)
+
+// The value of a register changed, flags it dirty if it's watched
+void watch_mark(uint8_t reg);
+
+void watch_set_mask(uint64_t mask);
+uint64_t watch_get_mask(void);
+
+uint64_t watch_get_dirty(void);
+
+// The host has seen these, once nothing is dirty anymore IN2_WATCH is cleared too
+void watch_clear_dirty(uint64_t bits);
+
+void watch_init(void);
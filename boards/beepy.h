@@ -17,6 +17,18 @@
 #define PIN_PUPPET_SDA		28
 #define PIN_PUPPET_SCL		29
 
+// serve the puppet from a PIO state machine instead of the I2C block (SCL has to be SDA + 1)
+// #define PUPPET_I2C_PIO
+
+// speak HID over I2C instead of the register map, for the stock i2c-hid driver (needs PUPPET_I2C_PIO)
+// #define PUPPET_I2C_HID
+
+// also answer as a DS3231 RTC at 0x68, for the stock rtc-ds1307 driver (needs PUPPET_I2C_PIO)
+// #define PUPPET_I2C_RTC
+
+// also answer as a PCAL6408 GPIO expander at 0x20, for the stock gpio-pca953x driver (needs PUPPET_I2C_PIO)
+// #define PUPPET_I2C_GPIO
+
 /** beeper specific pins **/
 #define PIN_PI_PWR 15
 #define PIN_PI_SHUTDOWN 21
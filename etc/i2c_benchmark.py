@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+#
+# Measure register polling throughput of the I2C puppet from the host side.
+#
+# The host bus speed is set by the host (on a Pi: `dtparam=i2c_arm_baudrate=...`
+# in config.txt), this script only switches the puppet side to match it, then
+# times the same workloads so the results can be compared between bus speeds.
+#
+#     pip install smbus2
+#     ./i2c_benchmark.py --bus 1 --speed fast
+
+import argparse
+import time
+
+from smbus2 import SMBus, i2c_msg
+
+_REG_INT = 0x03
+_REG_KEY = 0x04
+_REG_GIN = 0x10
+_REG_TOX = 0x15
+_REG_TOY = 0x16
+_REG_AIW = 0x18
+_REG_BUS = 0x1B
+
+_WRITE_MASK = 1 << 7
+
+SPEEDS = {
+    'standard': 0,
+    'fast': 1,
+    'fast-plus': 2,
+}
+
+
+def read_register(bus, addr, reg, length=1):
+    write = i2c_msg.write(addr, [reg])
+    read = i2c_msg.read(addr, length)
+    bus.i2c_rdwr(write, read)
+    return list(read)
+
+
+def write_register(bus, addr, reg, value):
+    bus.i2c_rdwr(i2c_msg.write(addr, [reg | _WRITE_MASK, value]))
+
+
+def bench(name, iterations, transactions, func):
+    start = time.monotonic()
+    for _ in range(iterations):
+        func()
+    elapsed = time.monotonic() - start
+
+    print('%-32s %8.1f polls/s %8.1f transactions/s %8.3f ms/poll' % (
+        name,
+        iterations / elapsed,
+        iterations * transactions / elapsed,
+        1000 * elapsed / iterations))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='I2C puppet throughput benchmark')
+    parser.add_argument('--bus', type=int, default=1, help='host I2C bus number')
+    parser.add_argument('--addr', type=lambda x: int(x, 0), default=0x1F, help='puppet address')
+    parser.add_argument('--speed', choices=SPEEDS.keys(), default='standard',
+                        help='puppet bus speed, must match the host bus speed')
+    parser.add_argument('--iterations', type=int, default=1000)
+    args = parser.parse_args()
+
+    with SMBus(args.bus) as bus:
+        bus_reg = read_register(bus, args.addr, _REG_BUS)[0]
+        write_register(bus, args.addr, _REG_BUS, (bus_reg & ~0x03) | SPEEDS[args.speed])
+        time.sleep(0.01)
+
+        # what a driver does on every interrupt without burst reads
+        regs = [_REG_INT, _REG_KEY, _REG_GIN, _REG_TOX, _REG_TOY]
+        bench('single register reads', args.iterations, len(regs),
+              lambda: [read_register(bus, args.addr, reg) for reg in regs])
+
+        # the same registers in one burst, REG_INT .. REG_TOY and everything in between,
+        # one byte each except REG_FIF (2 bytes, dequeues a key: don't type while it runs)
+        burst_regs = _REG_TOY - _REG_INT + 1
+        write_register(bus, args.addr, _REG_AIW, burst_regs)
+        bench('burst read', args.iterations, 1,
+              lambda: read_register(bus, args.addr, _REG_INT, burst_regs + 1))
+        write_register(bus, args.addr, _REG_AIW, 0)
+
+        # raw bus throughput, a long burst over a wrap window of side-effect free registers
+        write_register(bus, args.addr, _REG_AIW, 1)
+        bench('32 byte burst read', args.iterations, 1,
+              lambda: read_register(bus, args.addr, _REG_KEY, 32))
+        write_register(bus, args.addr, _REG_AIW, 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -1,3 +1,5 @@
+import struct
+
 import usb
 
 
@@ -23,6 +25,17 @@ _REG_IND = 0x13  # interrupt pin assert duration
 _REG_CF2 = 0x14  # config 2
 _REG_TOX = 0x15  # touch delta x since last read, at most (-128 to 127)
 _REG_TOY = 0x16  # touch delta y since last read, at most (-128 to 127)
+_REG_LAS = 0x35  # latency class select
+_REG_LAT = 0x36  # latency statistics of the selected class
+_REG_WCH = 0x37  # mask of registers to watch for changes
+_REG_DRT = 0x38  # watched registers that changed
+_REG_IN2 = 0x39  # interrupt status 2
+_REG_MTX = 0x3A  # raw key matrix
+_REG_FDP = 0x3B  # FIFO depth
+_REG_FWM = 0x3C  # FIFO high watermark
+_REG_FST = 0x3D  # FIFO statistics
+_REG_EVQ = 0x3E  # typed event queue
+_REG_KRS = 0x3F  # key ring reader statistics
 
 _WRITE_MASK      = 1 << 7
 
@@ -38,6 +51,11 @@ CFG_USE_MODS     = 1 << 7
 CF2_TOUCH_INT    = 1 << 0
 CF2_USB_KEYB_ON  = 1 << 1
 CF2_USB_MOUSE_ON = 1 << 2
+CF2_INT_LEVEL    = 1 << 3
+CF2_FIFO_V2      = 1 << 4
+CF2_HOST_NOTIFY  = 1 << 5
+CF2_USB_MATRIX   = 1 << 6
+CF2_EVENTS       = 1 << 7
 
 INT_OVERFLOW     = 1 << 0
 INT_CAPSLOCK     = 1 << 1
@@ -46,6 +64,21 @@ INT_KEY          = 1 << 3
 INT_PANIC        = 1 << 4
 INT_GPIO         = 1 << 5
 INT_TOUCH        = 1 << 6
+INT_IN2          = 1 << 7
+
+IN2_WATCH        = 1 << 0
+IN2_FIFO_WM      = 1 << 1
+IN2_EVENT        = 1 << 2
+
+FIFO_MOD_SHL     = 1 << 0
+FIFO_MOD_SHR     = 1 << 1
+FIFO_MOD_ALT     = 1 << 2
+FIFO_MOD_SYM     = 1 << 3
+
+EVENT_KEY        = 1
+EVENT_TOUCH      = 2
+EVENT_GPIO       = 3
+EVENT_SYSTEM     = 4
 
 KEY_CAPSLOCK     = 1 << 5
 KEY_NUMLOCK      = 1 << 6
@@ -57,6 +90,13 @@ DIR_INPUT        = 1
 PUD_DOWN         = 0
 PUD_UP           = 1
 
+LATENCY_READ_STATUS = 0
+LATENCY_READ_FIFO   = 1
+LATENCY_READ_OTHER  = 2
+LATENCY_WRITE       = 3
+
+LATENCY_BUCKETS  = 16
+
 
 class I2CPuppet:
     def __init__(self, vid=0x1209, pid=0xB182):
@@ -100,6 +140,96 @@ class I2CPuppet:
     def address(self, value):
         self._write_register(_REG_ADR, value)
 
+    def latency(self, cls):
+        """Returns (count, max cycles, log2 bucket counts) of the puppet I2C register accesses in a class"""
+        self._write_register(_REG_LAS, cls)
+        data = self._read_register_block(_REG_LAT, 8 + 2 * LATENCY_BUCKETS)
+
+        count, max_cycles = struct.unpack_from('<II', data)
+        buckets = struct.unpack_from('<%dH' % LATENCY_BUCKETS, data, 8)
+
+        return count, max_cycles, list(buckets)
+
+    def reset_latency(self, cls):
+        self._write_register(_REG_LAS, cls)
+        self._write_register(_REG_LAT, 0)
+
+    @property
+    def watch_mask(self):
+        return int.from_bytes(self._read_register_block(_REG_WCH, 8), 'little')
+
+    @watch_mask.setter
+    def watch_mask(self, value):
+        """Bit n watches register n for changes"""
+        self._write_register_block(_REG_WCH, value.to_bytes(8, 'little'))
+
+    def changed(self):
+        """Returns the mask of watched registers that changed since the last call"""
+        return int.from_bytes(self._read_register_block(_REG_DRT, 8), 'little')
+
+    @property
+    def matrix(self):
+        """Bit (row * columns + column) is set for every key down on the last scan, the buttons follow"""
+        return int.from_bytes(self._read_register_block(_REG_MTX, 8), 'little')
+
+    @property
+    def fifo_depth(self):
+        return int.from_bytes(self._read_register_block(_REG_FDP, 2), 'little')
+
+    @fifo_depth.setter
+    def fifo_depth(self, value):
+        self._write_register_block(_REG_FDP, value.to_bytes(2, 'little'))
+
+    @property
+    def fifo_watermark(self):
+        return int.from_bytes(self._read_register_block(_REG_FWM, 2), 'little')
+
+    @fifo_watermark.setter
+    def fifo_watermark(self, value):
+        """IN2_FIFO_WM is raised once this many events are queued, 0 turns it off"""
+        self._write_register_block(_REG_FWM, value.to_bytes(2, 'little'))
+
+    def fifo_stats(self):
+        """Returns (count, peak, enqueued, dropped, evicted holds, merged pairs, evicted presses,
+        kept releases, rejected) of the event FIFO"""
+        data = self._read_register_block(_REG_FST, 32)
+
+        return struct.unpack_from('<HH7I', data)
+
+    def reset_fifo_stats(self):
+        self._write_register(_REG_FST, 0)
+
+    def key_ring_stats(self, debug_build=False):
+        """Returns (read, lost) of the USB HID and USB vendor key ring readers, and the debug one on debug builds"""
+        readers = 3 if debug_build else 2
+        data = self._read_register_block(_REG_KRS, 8 * readers)
+        values = struct.unpack_from('<%dI' % (2 * readers), data)
+
+        return [values[i:i + 2] for i in range(0, 2 * readers, 2)]
+
+    def reset_key_ring_stats(self):
+        self._write_register(_REG_KRS, 0)
+
+    def events(self):
+        """Returns the queued (type, data, delta us) events, as many as fit a read. Needs CF2_EVENTS."""
+        data = self._read_register_block(_REG_EVQ, 64)
+        events = []
+
+        for i in range(data[0]):
+            event_type, payload, delta_us = struct.unpack_from('<B4sI', data, 1 + 9 * i)
+            if event_type == EVENT_TOUCH:
+                payload = struct.unpack('<hh', payload)
+
+            events.append((event_type, payload, delta_us))
+
+        return events
+
+    def _read_register_block(self, reg, length):
+        self._buffer[0] = reg
+        self._dev.write(self._ep_out, self._buffer[:1])
+
+        return bytes(self._dev.read(self._ep_in, length))
+
     def _read_register(self, reg):
         self._buffer[0] = reg
         self._dev.write(self._ep_out, self._buffer[:1])
@@ -111,6 +241,9 @@ class I2CPuppet:
         self._buffer[1] = value
         self._dev.write(self._ep_out, self._buffer)
 
+    def _write_register_block(self, reg, data):
+        self._dev.write(self._ep_out, bytes([reg | _WRITE_MASK]) + bytes(data))
+
     def _update_register_bit(self, reg, bit, value):
 
         reg_val = self._read_register(reg)
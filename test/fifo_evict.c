@@ -0,0 +1,304 @@
+// The fifo_enqueue_force() overflow policy, and it making room while a REG_ID_FIB read is on the
+// bus: the entries that read peeked at have to stay put, so committing it discards exactly what
+// the host got.
+
+#include "fifo.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+pthread_mutex_t test_irq_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int failures;
+
+#define EXPECT(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: %s\n", __func__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static struct fifo_item make_item(uint8_t key, enum key_state state)
+{
+	struct fifo_item item = { 0 };
+
+	item.scancode = key;
+	item.state = state;
+
+	return item;
+}
+
+// what the key scan does with a new event when CFG_OVERFLOW_ON is set or it's a release
+static void report(uint8_t key, enum key_state state)
+{
+	const struct fifo_item item = make_item(key, state);
+
+	if (!fifo_enqueue(item))
+		fifo_enqueue_force(item);
+}
+
+static bool is(const struct fifo_item item, uint8_t key, enum key_state state)
+{
+	return (item.scancode == key) && (item.state == state);
+}
+
+// read_fifo_bulk() peeks and reserves, commit_fifo_bulk() discards what was clocked out
+static uint16_t bulk_read(struct fifo_item *out, uint16_t max)
+{
+	const uint16_t count = (fifo_count() < max) ? fifo_count() : max;
+
+	for (uint16_t i = 0; i < count; ++i)
+		out[i] = fifo_peek(i);
+
+	fifo_reserve(count);
+
+	return count;
+}
+
+static void reset(uint16_t capacity)
+{
+	fifo_flush();
+	fifo_set_capacity(capacity);
+	fifo_reset_stats();
+}
+
+static void expect_item(uint16_t idx, uint8_t key, enum key_state state)
+{
+	const struct fifo_item item = fifo_peek(idx);
+
+	if (!is(item, key, state)) {
+		fprintf(stderr, "item %u: expected %u/%u, got %u/%u\n",
+			idx, key, state, item.scancode, item.state);
+		failures++;
+	}
+}
+
+// every counter, so a test also catches the policy doing something it shouldn't have
+static void expect_stats(uint16_t peak, uint32_t enqueued, uint32_t dropped, uint32_t evicted_hold,
+	uint32_t merged_pairs, uint32_t evicted_press, uint32_t kept_release, uint32_t rejected)
+{
+	const struct fifo_stats *stats = fifo_get_stats();
+
+	EXPECT(stats->peak == peak);
+	EXPECT(stats->enqueued == enqueued);
+	EXPECT(stats->dropped == dropped);
+	EXPECT(stats->evicted_hold == evicted_hold);
+	EXPECT(stats->merged_pairs == merged_pairs);
+	EXPECT(stats->evicted_press == evicted_press);
+	EXPECT(stats->kept_release == kept_release);
+	EXPECT(stats->rejected == rejected);
+}
+
+// a HOLD goes before anything else, even with a pair and a lone press in the queue
+static void test_hold_first(void)
+{
+	reset(4);
+
+	report(KEY_A, KEY_STATE_PRESSED);
+	report(KEY_A, KEY_STATE_RELEASED);
+	report(KEY_B, KEY_STATE_HOLD);
+	report(KEY_C, KEY_STATE_PRESSED);
+
+	report(KEY_D, KEY_STATE_PRESSED);
+
+	EXPECT(fifo_count() == 4);
+	expect_item(0, KEY_A, KEY_STATE_PRESSED);
+	expect_item(1, KEY_A, KEY_STATE_RELEASED);
+	expect_item(2, KEY_C, KEY_STATE_PRESSED);
+	expect_item(3, KEY_D, KEY_STATE_PRESSED);
+	expect_stats(4, 5, 1, 1, 0, 0, 0, 0);
+}
+
+// without a HOLD, a press and the release of the same key go together, other releases stay
+static void test_merges_pair(void)
+{
+	reset(4);
+
+	report(KEY_B, KEY_STATE_PRESSED);
+	report(KEY_C, KEY_STATE_RELEASED);
+	report(KEY_A, KEY_STATE_PRESSED);
+	report(KEY_A, KEY_STATE_RELEASED);
+
+	report(KEY_D, KEY_STATE_PRESSED);
+
+	EXPECT(fifo_count() == 3);
+	expect_item(0, KEY_B, KEY_STATE_PRESSED);
+	expect_item(1, KEY_C, KEY_STATE_RELEASED);
+	expect_item(2, KEY_D, KEY_STATE_PRESSED);
+	expect_stats(4, 5, 1, 0, 1, 0, 0, 0);
+}
+
+// a release queued before the press doesn't make a pair, the oldest press goes
+static void test_evicts_press_without_pair(void)
+{
+	reset(4);
+
+	report(KEY_B, KEY_STATE_RELEASED);
+	report(KEY_A, KEY_STATE_PRESSED);
+	report(KEY_B, KEY_STATE_PRESSED);
+	report(KEY_C, KEY_STATE_RELEASED);
+
+	report(KEY_E, KEY_STATE_PRESSED);
+
+	EXPECT(fifo_count() == 4);
+	expect_item(0, KEY_B, KEY_STATE_RELEASED);
+	expect_item(1, KEY_B, KEY_STATE_PRESSED);
+	expect_item(2, KEY_C, KEY_STATE_RELEASED);
+	expect_item(3, KEY_E, KEY_STATE_PRESSED);
+	expect_stats(4, 5, 1, 0, 0, 1, 0, 0);
+}
+
+// nothing but releases queued: a release still goes in over the capacity, a press doesn't
+static void test_keeps_unmatched_release(void)
+{
+	reset(4);
+
+	report(KEY_A, KEY_STATE_RELEASED);
+	report(KEY_B, KEY_STATE_RELEASED);
+	report(KEY_C, KEY_STATE_RELEASED);
+	report(KEY_D, KEY_STATE_RELEASED);
+
+	report(KEY_E, KEY_STATE_RELEASED);
+
+	EXPECT(fifo_count() == 5);
+	expect_item(4, KEY_E, KEY_STATE_RELEASED);
+	expect_stats(5, 5, 1, 0, 0, 0, 1, 0);
+
+	report(KEY_F, KEY_STATE_PRESSED);
+
+	EXPECT(fifo_count() == 5);
+	expect_item(0, KEY_A, KEY_STATE_RELEASED);
+	expect_stats(5, 5, 2, 0, 0, 0, 1, 1);
+}
+
+// the release that forced the eviction mustn't be discarded with the read
+static void test_release_during_read(void)
+{
+	struct fifo_item sent[4];
+
+	reset(4);
+
+	report(KEY_A, KEY_STATE_PRESSED);
+	report(KEY_B, KEY_STATE_PRESSED);
+	report(KEY_C, KEY_STATE_PRESSED);
+	report(KEY_D, KEY_STATE_PRESSED);
+
+	EXPECT(bulk_read(sent, 4) == 4);
+
+	// nothing outside the read to evict, it goes in over the capacity
+	report(KEY_A, KEY_STATE_RELEASED);
+
+	fifo_discard(4);
+
+	EXPECT(is(sent[0], KEY_A, KEY_STATE_PRESSED));
+	EXPECT(is(sent[3], KEY_D, KEY_STATE_PRESSED));
+	EXPECT(fifo_count() == 1);
+	EXPECT(is(fifo_peek(0), KEY_A, KEY_STATE_RELEASED));
+	EXPECT(fifo_get_stats()->evicted_press == 0);
+	EXPECT(fifo_get_stats()->kept_release == 1);
+}
+
+// only what comes after the read is up for eviction
+static void test_evicts_after_read(void)
+{
+	struct fifo_item sent[2];
+
+	reset(4);
+
+	report(KEY_A, KEY_STATE_PRESSED);
+	report(KEY_B, KEY_STATE_HOLD);
+	report(KEY_C, KEY_STATE_PRESSED);
+	report(KEY_D, KEY_STATE_HOLD);
+
+	EXPECT(bulk_read(sent, 2) == 2);
+
+	report(KEY_E, KEY_STATE_PRESSED);
+
+	fifo_discard(2);
+
+	EXPECT(is(sent[1], KEY_B, KEY_STATE_HOLD));
+	EXPECT(fifo_count() == 2);
+	EXPECT(is(fifo_peek(0), KEY_C, KEY_STATE_PRESSED));
+	EXPECT(is(fifo_peek(1), KEY_E, KEY_STATE_PRESSED));
+	EXPECT(fifo_get_stats()->evicted_hold == 1);
+}
+
+// the host NACKed halfway, the rest of the read is back to being evictable
+static void test_partial_read(void)
+{
+	struct fifo_item sent[4];
+
+	reset(4);
+
+	report(KEY_A, KEY_STATE_PRESSED);
+	report(KEY_B, KEY_STATE_PRESSED);
+	report(KEY_C, KEY_STATE_PRESSED);
+	report(KEY_D, KEY_STATE_PRESSED);
+
+	EXPECT(bulk_read(sent, 4) == 4);
+
+	// a press can't go over the capacity
+	report(KEY_E, KEY_STATE_PRESSED);
+	EXPECT(fifo_get_stats()->rejected == 1);
+
+	fifo_discard(2);
+
+	EXPECT(fifo_count() == 2);
+	EXPECT(is(fifo_peek(0), KEY_C, KEY_STATE_PRESSED));
+
+	report(KEY_F, KEY_STATE_PRESSED);
+	report(KEY_G, KEY_STATE_PRESSED);
+	report(KEY_H, KEY_STATE_PRESSED);
+
+	EXPECT(fifo_get_stats()->evicted_press == 1);
+	EXPECT(fifo_count() == 4);
+	EXPECT(is(fifo_peek(0), KEY_D, KEY_STATE_PRESSED));
+	EXPECT(is(fifo_peek(3), KEY_H, KEY_STATE_PRESSED));
+}
+
+// REG_ID_FIF dequeues one by one, what's left of the read stays reserved
+static void test_dequeue_during_read(void)
+{
+	struct fifo_item sent[3];
+
+	reset(4);
+
+	report(KEY_A, KEY_STATE_PRESSED);
+	report(KEY_B, KEY_STATE_PRESSED);
+	report(KEY_C, KEY_STATE_PRESSED);
+	report(KEY_D, KEY_STATE_PRESSED);
+
+	EXPECT(bulk_read(sent, 3) == 3);
+	EXPECT(is(fifo_dequeue(), KEY_A, KEY_STATE_PRESSED));
+
+	report(KEY_E, KEY_STATE_PRESSED);
+	report(KEY_F, KEY_STATE_PRESSED);
+
+	// B and C are still on their way, D made room for F
+	EXPECT(fifo_get_stats()->evicted_press == 1);
+	EXPECT(is(fifo_peek(0), KEY_B, KEY_STATE_PRESSED));
+	EXPECT(is(fifo_peek(1), KEY_C, KEY_STATE_PRESSED));
+	EXPECT(is(fifo_peek(2), KEY_E, KEY_STATE_PRESSED));
+	EXPECT(is(fifo_peek(3), KEY_F, KEY_STATE_PRESSED));
+}
+
+int main(void)
+{
+	test_hold_first();
+	test_merges_pair();
+	test_evicts_press_without_pair();
+	test_keeps_unmatched_release();
+	test_release_during_read();
+	test_evicts_after_read();
+	test_partial_read();
+	test_dequeue_during_read();
+
+	if (failures > 0)
+		return EXIT_FAILURE;
+
+	printf("all passed\n");
+
+	return EXIT_SUCCESS;
+}
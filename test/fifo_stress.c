@@ -0,0 +1,119 @@
+// The key scan and the register reads on two threads, hammering the FIFO: every item has to come
+// out once, in order and intact, with the indices wrapping around many times.
+
+#include "fifo.h"
+
+#include <pico/stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ITEMS			2000000
+
+// small enough to be full most of the time
+#define CAPACITY		8
+
+// the most a REG_ID_FIB read peeks at once
+#define BULK			7
+
+pthread_mutex_t test_irq_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct fifo_item make_item(uint32_t seq)
+{
+	struct fifo_item item = { 0 };
+
+	item.scancode = seq & 0xFF;
+	item.state = (seq & 1) ? KEY_STATE_PRESSED : KEY_STATE_RELEASED;
+	item.mods = (seq >> 8) & 0x0F;
+	item.time_us = seq;
+
+	return item;
+}
+
+static void *producer(void *arg)
+{
+	(void)arg;
+
+	for (uint32_t seq = 1; seq <= ITEMS; ++seq) {
+		const struct fifo_item item = make_item(seq);
+
+		while (!fifo_enqueue(item))
+			sched_yield();
+	}
+
+	return NULL;
+}
+
+static bool check(const struct fifo_item *item, uint32_t seq)
+{
+	const struct fifo_item expected = make_item(seq);
+
+	if ((item->time_us == expected.time_us) && (item->scancode == expected.scancode) &&
+		(item->state == expected.state) && (item->mods == expected.mods))
+		return true;
+
+	fprintf(stderr, "item %u: got scancode %u state %u mods %u time %u\n", seq,
+		item->scancode, item->state, item->mods, item->time_us);
+
+	return false;
+}
+
+int main(void)
+{
+	pthread_t thread;
+	uint32_t seq = 1;
+	bool ok = true;
+
+	fifo_set_capacity(CAPACITY);
+
+	pthread_create(&thread, NULL, producer, NULL);
+
+	// register reads run with interrupts off, alternating between REG_ID_FIF and REG_ID_FIB
+	while (ok && (seq <= ITEMS)) {
+		pthread_mutex_lock(&test_irq_lock);
+
+		const uint16_t count = fifo_count();
+
+		if (count > CAPACITY) {
+			fprintf(stderr, "%u items queued, capacity is %u\n", count, CAPACITY);
+			ok = false;
+		} else if ((count > 0) && (seq & 1)) {
+			const struct fifo_item item = fifo_dequeue();
+
+			ok = check(&item, seq++);
+		} else if (count > 0) {
+			const uint16_t bulk = MIN(count, BULK);
+
+			for (uint16_t i = 0; ok && (i < bulk); ++i) {
+				const struct fifo_item item = fifo_peek(i);
+
+				ok = check(&item, seq + i);
+			}
+
+			fifo_discard(bulk);
+			seq += bulk;
+		}
+
+		pthread_mutex_unlock(&test_irq_lock);
+
+		if (count == 0)
+			sched_yield();
+	}
+
+	if (!ok) {
+		// the producer may be waiting for room that never comes
+		return EXIT_FAILURE;
+	}
+
+	pthread_join(thread, NULL);
+
+	if (fifo_count() != 0) {
+		fprintf(stderr, "%u items left over\n", fifo_count());
+		return EXIT_FAILURE;
+	}
+
+	printf("%u items in order\n", ITEMS);
+
+	return EXIT_SUCCESS;
+}
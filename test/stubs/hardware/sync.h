@@ -0,0 +1,27 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdint.h>
+
+// On the chip, interrupts off keeps the producer (the key scan) out. Here it's a lock the
+// consumer holds for what runs with interrupts off in the firmware.
+extern pthread_mutex_t test_irq_lock;
+
+static inline void __dmb(void)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t save_and_disable_interrupts(void)
+{
+	pthread_mutex_lock(&test_irq_lock);
+
+	return 0;
+}
+
+static inline void restore_interrupts(uint32_t status)
+{
+	(void)status;
+
+	pthread_mutex_unlock(&test_irq_lock);
+}